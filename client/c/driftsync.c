@@ -1,23 +1,84 @@
+#define _GNU_SOURCE
+
 #include <driftsync.h>
+#include <driftsync_probes.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 
 #define SCALE_US 1.0
 #define SCALE_MS SCALE_US / 1000
 #define SALE_S = SCALE_MS / 1000
 
+#define STATE_UNSYNCHRONIZED	0
+#define STATE_LOCKED			1
+#define STATE_HOLDOVER			2
+
+#define HOLDOVER_INTERVALS		3
+#define DEFAULT_RATE_STABILITY	50e-6
+#define MAX_SLEW_RATE			500e-6
+
+#define PEER_TABLE_SIZE			32
+#define PEER_ANNOUNCE_INTERVAL	(1000 * 1000)
+#define PEER_TIMEOUT			(3 * PEER_ANNOUNCE_INTERVAL)
+
+#define ESTIMATE_HISTORY		32
+
+#define MAX_PATHS				8
+#define PATH_SAMPLES			10
+#define PATH_MIN_SAMPLES		3
+	// replies a path needs before it can replace the active one
+#define PATH_HYSTERESIS			0.8
+	// fraction of the score of the active path another has to get below
+
+#define CUE_HISTORY				64
+	// numbers of recently received cues, to drop retransmissions of them
+#define CUE_SUBSCRIBE_INTERVAL	(1000 * 1000)
+#define CUE_SPIN				1000
+	// microseconds before a cue is due from which dispatching spins
+#define CUE_REPROJECT			(100 * 1000)
+	// longest sleep before the due time of a cue is projected again
+#define CUE_PUBLISH_TIMEOUT		(100 * 1000)
+#define CUE_PUBLISH_ATTEMPTS	10
+
+#define DELAY_SUB_BITS			5
+	// one way delay buckets per power of two, spaced 3% apart
+#define DELAY_BUCKETS			((31 - DELAY_SUB_BITS + 2) << DELAY_SUB_BITS)
+#define PLAYOUT_UPDATE_PACKETS	32
+
+#define ARCHIVE_BLOCK_SIZE		1024
+	// bytes of encoded records per archive block
+#define ARCHIVE_RECORD_BITS		227
+	// longest encoding of a record, 68 for the local time, 78 for each of
+	// the offset and round trip time and 3 for the decision
+
+#define ARCHIVE_ACCEPTED		0
+#define ARCHIVE_REJECTED		1
+#define ARCHIVE_EPOCH_CHANGE	2
+	// accepted after discarding the samples of the previous epoch
+#define ARCHIVE_SOURCE_CHANGE	3
+	// accepted after discarding the samples of the previous source
+
 
 struct sample {
 	int64_t local;
@@ -29,6 +90,22 @@ struct statistics {
 	int sentRequests;
 	int receivedSamples;
 	int rejectedSamples;
+	int epochChanges;
+	int servedRequests;
+};
+
+
+struct path_statistics {
+	char name[32];
+	int active;
+	int sentRequests;
+	int receivedSamples;
+	double roundTripTime;
+		// median of the recent replies
+	double offset;
+		// average offset of the recent replies from the global time
+	double deviation;
+		// standard deviation of these offsets
 };
 
 
@@ -39,6 +116,100 @@ struct accuracy {
 };
 
 
+// Replaces the UDP socket, for example to carry the packets inside an existing
+// connection of the application. Packets received through the application can
+// also be handed to DRIFTsync_deliver when no receive callback is set.
+
+struct transport {
+	void *context;
+		// passed to the callbacks
+	int (*send)(void *context, const void *packet, int length);
+		// sends a request to the server, returns the sent length or -1
+	int (*receive)(void *context, void *packet, int length, double *arrival);
+		// blocks until a reply is received, returns its length or -1 and may
+		// set arrival to the local time at which the packet arrived, NULL when
+		// replies are delivered by the application
+};
+
+
+struct options {
+	int realtimePriority;
+		// SCHED_FIFO priority of the receive thread, 0 to keep the default
+	int cpu;
+		// CPU to pin the receive thread to, -1 for no affinity
+	int busyPoll;
+		// SO_BUSY_POLL time in microseconds, 0 to disable
+	int dscp;
+		// differentiated services code point of requests, -1 for default
+	int socketPriority;
+		// SO_PRIORITY of requests, -1 for default
+	int refclockUnit;
+		// NTP SHM refclock unit to publish the wall clock to, -1 to disable
+	int coarseInterval;
+		// update interval of the coarse global time in microseconds, 0 to
+		// disable
+	int polled;
+		// run without threads, the application has to call DRIFTsync_poll
+	int wakeupLead;
+		// time in microseconds to send a wake-up packet ahead of each request
+		// to bring the link out of power saving, 0 to disable
+	int peerPort;
+		// UDP port to discover peers on and elect a leader that alone
+		// synchronizes to the server, 0 to disable
+	int peerInterval;
+		// request interval in microseconds while following a peer leader
+	const struct transport *transport;
+		// callbacks to exchange packets with instead of a UDP socket, NULL to
+		// use UDP, must stay valid until quit
+	int telemetry;
+		// send a summary of the synchronization state along with requests
+	const char *paths;
+		// comma separated interfaces or local addresses to send requests
+		// from, each over its own socket, NULL to use the default route
+};
+
+
+// Updated by the ticker thread and read without locking, kept on its own cache
+// line so that readers are not disturbed by writes to the sync struct.
+
+struct coarse_time {
+	int64_t time;
+	int64_t lag;
+} __attribute__((__aligned__(64)));
+
+
+// Shared memory segment layout of the NTP SHM reference clock driver as used
+// by ntpd and chrony.
+
+#define NTP_SHM_KEY	0x4e545030 // 'NTP0'
+
+struct ntp_shm_time {
+	int mode;
+	volatile int count;
+	time_t clockTimeStampSec;
+	int clockTimeStampUSec;
+	time_t receiveTimeStampSec;
+	int receiveTimeStampUSec;
+	int leap;
+	int precision;
+	int nsamples;
+	volatile int valid;
+	unsigned clockTimeStampNSec;
+	unsigned receiveTimeStampNSec;
+	int dummy[8];
+};
+
+
+// A client in peer mode as last announced on the broadcast domain.
+
+struct peer {
+	uint64_t id;
+	uint64_t epoch;
+	struct sockaddr_in address;
+	int64_t lastSeen;
+};
+
+
 struct ring_buffer {
 	void *buffer;
 	size_t size;
@@ -126,29 +297,291 @@ ring_buffer_median(struct ring_buffer *buffer,
 }
 
 
+// Everything needed to derive the global time and its error bounds. Published
+// by the receive path on every change and read without locking.
+
+// A route to the server through one interface or from one local address. All
+// paths are measured on every request, the estimator only follows the best.
+
+struct path {
+	char name[32];
+	int socket;
+	struct ring_buffer roundTripTimes;
+	struct ring_buffer offsets;
+		// offsets of replies from the global time at their midpoint
+	uint64_t epoch;
+	int sentRequests;
+	int receivedSamples;
+	int64_t lastReceived;
+};
+
+
+struct estimate {
+	int64_t reference;
+	int64_t offset;
+	double clockRate;
+	int64_t lastAccepted;
+	int64_t delayBound;
+	int64_t residualError;
+	double rateStability;
+	int64_t slewOffset;
+	int64_t slewStart;
+	int64_t slewDuration;
+};
+
+
+// An estimate along with the local time from which on it was in effect, kept
+// for converting events recorded in the past.
+
+struct published_estimate {
+	int64_t validFrom;
+	struct estimate estimate;
+};
+
+
+// Application event stamped with the local monotonic time in nanoseconds.
+
+struct event {
+	int64_t time;
+	uint64_t data;
+};
+
+
+struct global_event {
+	double time;
+	uint64_t data;
+};
+
+
+// Single producer, single consumer ring of events. The recording thread only
+// writes the head, the flushing one only the tail, each on its own cache line.
+
+struct event_log {
+	struct DRIFTsync *sync;
+	size_t mask;
+	size_t head __attribute__((__aligned__(64)));
+	unsigned dropped;
+	size_t tail __attribute__((__aligned__(64)));
+	struct event events[] __attribute__((__aligned__(64)));
+};
+
+
+// Cue as dispatched, due at a global time in the scale of the sync.
+
+struct cue {
+	double time;
+	uint64_t sequence;
+	size_t length;
+	uint8_t payload[DRIFTSYNC_CUE_PAYLOAD];
+};
+
+
+struct queued_cue {
+	int64_t time;
+	uint64_t sequence;
+	uint16_t length;
+	uint8_t payload[DRIFTSYNC_CUE_PAYLOAD];
+};
+
+
+// Cues received from the cue service, kept in a binary heap ordered by global
+// time until they are dispatched.
+
+struct cue_queue {
+	struct DRIFTsync *sync;
+	pthread_mutex_t lock;
+	pthread_cond_t condition;
+		// waits on the monotonic clock
+	pthread_mutex_t publishLock;
+	int socket;
+	int subscribe;
+	struct queued_cue *heap;
+	size_t count;
+	size_t capacity;
+	uint64_t received[CUE_HISTORY];
+	size_t receivedPosition;
+	uint64_t publishId;
+	int64_t publishedTime;
+	int publishAnswered;
+	unsigned late;
+	int quitting;
+	pthread_t thread;
+};
+
+
+// Counts of one way delays within a window of local time, reset when it is
+// reused for a later window.
+
+struct delay_histogram {
+	uint64_t window;
+	uint32_t counts[DELAY_BUCKETS];
+};
+
+
+// Playout deadlines for packets stamped with the global time of their sender,
+// from the delays of the last one or two windows. All counters are updated
+// atomically, so packets can be ingested from any number of threads.
+
+struct jitter_buffer {
+	struct DRIFTsync *sync;
+	double percentile;
+	int64_t margin;
+	int64_t window;
+	struct delay_histogram histograms[2];
+	uint64_t packets;
+	uint64_t late;
+	int64_t playoutDelay;
+		// -1 until the first packet
+};
+
+
+// Exchange as stored in a sample archive, in the scale of the sync.
+
+struct archived_sample {
+	double local;
+	double remote;
+	double roundTripTime;
+	int decision;
+};
+
+
+// Previous value of an XOR encoded series and the window of meaningful bits
+// of its last difference, leading is -1 before the first difference.
+
+struct xor_series {
+	uint64_t value;
+	int leading;
+	int trailing;
+};
+
+
+struct archive_state {
+	int64_t local;
+	int64_t delta;
+	struct xor_series offset;
+	struct xor_series roundTripTime;
+	int decision;
+};
+
+
+// Records are encoded like in Gorilla, the local time as the difference of
+// consecutive deltas, offset and round trip time XORed with their previous
+// value. Every block starts over, so a range only decodes the blocks it
+// overlaps.
+
+struct archive_block {
+	int64_t lowest;
+	int64_t highest;
+		// smallest and largest local time of its records
+	uint32_t count;
+	uint32_t bits;
+	uint8_t data[ARCHIVE_BLOCK_SIZE];
+};
+
+
+// Ring of blocks that drops the oldest one when full. Appended to by the
+// receive thread under the lock of the sync, read by any thread.
+
+struct sample_archive {
+	struct DRIFTsync *sync;
+	pthread_mutex_t lock;
+	size_t capacity;
+	size_t first;
+	size_t count;
+	uint64_t dropped;
+	uint64_t droppedBlocks;
+		// also the sequence number of the first block
+	struct archive_state state;
+	struct archive_block *blocks;
+};
+
+
 struct DRIFTsync {
 	pthread_mutex_t lock;
 	pthread_cond_t condition;
 	size_t maxSamples;
 	int socket;
 	struct sockaddr_storage server;
+	struct sockaddr_storage upstream;
 	struct ring_buffer roundTripTimes;
 	struct ring_buffer sortedRoundTripTimes;
 	struct ring_buffer samples;
 	double clockRate;
 	struct ring_buffer offsets;
+	struct ring_buffer acceptedRoundTripTimes;
+		// round trip times of the samples the offsets come from
 	int64_t averageOffset;
+	int64_t lastResidual;
+	int64_t lastAccepted;
+	int64_t newestRequest;
+		// local time of the newest request a reply was processed for
+	int64_t holdoverTimeout;
+	int64_t delayBound;
+	int64_t residualError;
+	double rateStability;
+	int64_t slewOffset;
+	int64_t slewStart;
+	int64_t slewDuration;
+	unsigned generation;
+	struct estimate estimate;
+	struct published_estimate history[ESTIMATE_HISTORY];
+	size_t historyCount;
+	size_t historyPosition;
 	struct ring_buffer accuracySamples;
 	struct statistics statistics;
+	uint64_t epoch;
+	uint32_t wallClock;
+	int64_t wallClockOffset;
 	struct timespec interval;
+	struct timespec peerInterval;
+	struct options options;
+	struct ntp_shm_time *refclock;
 	double scale;
 	int measureAccuracy;
 	int quitting;
+	struct coarse_time *coarse;
+	int64_t nextRequest;
+	int wakeupSent;
+	struct driftsync_wall_clock_packet request;
+	int receiving;
+	int peerSocket;
+	uint16_t servicePort;
+	uint64_t peerId;
+	uint64_t leaderId;
+	int following;
+	int sourceChanged;
+	int64_t sourceChange;
+		// local time of the last source switch, requests sent before it
+		// went to the previous source
+	struct peer *peers;
+	struct sample_archive *archive;
+	struct path *paths;
+	size_t pathCount;
+	size_t activePath;
+		// pathCount until the first reply
 	pthread_t requestThread;
 	pthread_t receiveThread;
+	pthread_t tickerThread;
+	pthread_t peerThread;
 };
 
 
+static inline void
+lockSync(struct DRIFTsync *sync)
+{
+	if (!sync->options.polled)
+		pthread_mutex_lock(&sync->lock);
+}
+
+
+static inline void
+unlockSync(struct DRIFTsync *sync)
+{
+	if (!sync->options.polled)
+		pthread_mutex_unlock(&sync->lock);
+}
+
+
 static inline int64_t
 localTime()
 {
@@ -159,21 +592,115 @@ localTime()
 }
 
 
+static void
+publishEstimate(struct DRIFTsync *sync)
+{
+	struct estimate estimate = {
+		.reference = sync->samples.count > 0
+			? ((struct sample *)ring_buffer_get(&sync->samples,
+				sync->samples.count - 1))->local : 0,
+		.offset = sync->averageOffset,
+		.clockRate = sync->clockRate,
+		.lastAccepted = sync->lastAccepted,
+		.delayBound = sync->delayBound,
+		.residualError = sync->residualError,
+		.rateStability = sync->rateStability,
+		.slewOffset = sync->slewOffset,
+		.slewStart = sync->slewStart,
+		.slewDuration = sync->slewDuration
+	};
+
+	// Sequence lock, the generation is odd while the estimate is written.
+	unsigned generation = sync->generation;
+	__atomic_store_n(&sync->generation, generation + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	sync->estimate = estimate;
+	__atomic_store_n(&sync->generation, generation + 2, __ATOMIC_RELEASE);
+
+	// Only read under the lock when flushing event logs.
+	sync->historyPosition = (sync->historyPosition + 1) % ESTIMATE_HISTORY;
+	sync->history[sync->historyPosition].validFrom = localTime();
+	sync->history[sync->historyPosition].estimate = estimate;
+	if (sync->historyCount < ESTIMATE_HISTORY)
+		sync->historyCount++;
+}
+
+
+static void
+readEstimate(struct DRIFTsync *sync, struct estimate *estimate)
+{
+	unsigned generation;
+	do {
+		generation = __atomic_load_n(&sync->generation, __ATOMIC_ACQUIRE);
+		memcpy(estimate, &sync->estimate, sizeof(struct estimate));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((generation & 1) != 0
+		|| generation != __atomic_load_n(&sync->generation, __ATOMIC_RELAXED));
+}
+
+
 static int64_t
-globalTime(struct DRIFTsync *sync)
+estimateSlew(const struct estimate *estimate, int64_t local)
 {
-	pthread_mutex_lock(&sync->lock);
+	// Gradually removes the step between holdover and the new estimate.
+	int64_t slewed = local - estimate->slewStart;
+	if (slewed >= estimate->slewDuration)
+		return 0;
 
-	int64_t result = 0;
-	if (sync->samples.count > 0) {
-		int64_t reference = ((struct sample *)ring_buffer_get(&sync->samples,
-				sync->samples.count - 1))->local;
-		result = reference + sync->averageOffset
-			+ (int64_t)((localTime() - reference) * sync->clockRate);
-	}
+	return estimate->slewOffset
+		- estimate->slewOffset * slewed / estimate->slewDuration;
+}
 
-	pthread_mutex_unlock(&sync->lock);
-	return result;
+
+static int64_t
+estimateTime(const struct estimate *estimate, int64_t local)
+{
+	if (estimate->lastAccepted == 0)
+		return 0;
+
+	return estimate->reference + estimate->offset
+		+ (int64_t)((local - estimate->reference) * estimate->clockRate)
+		+ estimateSlew(estimate, local);
+}
+
+
+static int64_t
+estimateError(const struct estimate *estimate, int64_t local)
+{
+	// Symmetric part of the error, the request delay contained in the offsets
+	// is accounted for separately by the delay bound.
+	int64_t slew = estimateSlew(estimate, local);
+	return estimate->residualError
+		+ (int64_t)((local - estimate->lastAccepted) * estimate->rateStability)
+		+ (slew < 0 ? -slew : slew);
+}
+
+
+static int64_t
+estimateLocal(const struct estimate *estimate, int64_t global)
+{
+	// Inverse of estimateTime, with the slew taken at the local time without
+	// it, which is off by at most the slew rate times the slew.
+	int64_t local = estimate->reference + (int64_t)((global
+		- estimate->reference - estimate->offset) / estimate->clockRate);
+	return local
+		- (int64_t)(estimateSlew(estimate, local) / estimate->clockRate);
+}
+
+
+static int64_t
+globalTimeAt(struct DRIFTsync *sync, int64_t local)
+{
+	return estimateTime(&sync->estimate, local);
+}
+
+
+static int64_t
+globalTime(struct DRIFTsync *sync)
+{
+	struct estimate estimate;
+	readEstimate(sync, &estimate);
+	return estimateTime(&estimate, localTime());
 }
 
 
@@ -188,306 +715,2864 @@ static int64_t
 medianRoundTripTime(struct DRIFTsync *sync, int locked)
 {
 	if (!locked)
-		pthread_mutex_lock(&sync->lock);
+		lockSync(sync);
 
 	ring_buffer_copy(&sync->roundTripTimes, &sync->sortedRoundTripTimes);
 	int64_t result = *(int64_t *)ring_buffer_median(&sync->sortedRoundTripTimes,
 		compare_int64_t);
 
 	if (!locked)
-		pthread_mutex_unlock(&sync->lock);
+		unlockSync(sync);
 
 	return result;
 }
 
 
-static void *
-request_loop(void *data)
+static void
+initRequest(struct driftsync_wall_clock_packet *buffer)
 {
-	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->packet.magic = DRIFTSYNC_MAGIC;
+	buffer->packet.flags = DRIFTSYNC_FLAG_WALL_CLOCK;
+}
 
-	struct driftsync_packet packet;
-	memset(&packet, 0, sizeof(packet));
-	packet.magic = DRIFTSYNC_MAGIC;
 
-	while (!sync->quitting) {
-		sync->statistics.sentRequests++;
+static void
+currentServer(struct DRIFTsync *sync, struct sockaddr_storage *server)
+{
+	// Changes in peer mode whenever a different leader is elected.
+	lockSync(sync);
+	memcpy(server, &sync->server, sizeof(*server));
+	unlockSync(sync);
+}
 
-		packet.local = localTime();
-		int result = sendto(sync->socket, &packet, sizeof(packet), 0,
-			(struct sockaddr *)&sync->server, sizeof(sync->server));
 
-		if (result < 0) {
-			printf("failed to send: %s\n", strerror(errno));
-			continue;
-		}
+static int
+transmit(struct DRIFTsync *sync, const void *packet, int length)
+{
+	const struct transport *transport = sync->options.transport;
+	if (transport != NULL)
+		return transport->send(transport->context, packet, length);
 
-		if (result != (int)sizeof(packet)) {
-			printf("sent incomplete packet of %d\n", result);
-			continue;
-		}
+	struct sockaddr_storage server;
+	currentServer(sync, &server);
 
-		nanosleep(&sync->interval, NULL);
+	if (sync->paths == NULL) {
+		return sendto(sync->socket, packet, length, 0,
+			(struct sockaddr *)&server, sizeof(server));
 	}
 
-	return NULL;
+	// Succeeds when any of the paths is up.
+	int result = -1;
+	for (size_t i = 0; i < sync->pathCount; i++) {
+		int sent = sendto(sync->paths[i].socket, packet, length, 0,
+			(struct sockaddr *)&server, sizeof(server));
+		if (sent >= 0)
+			result = sent;
+	}
+
+	return result;
 }
 
 
 static void
-sum_int64_t(void *data, void *state)
+sendPathRequests(struct DRIFTsync *sync,
+	struct driftsync_wall_clock_packet *buffer)
 {
-	*(int64_t *)state += *(int64_t *)data;
+	// Every path gets its own timestamp right before its send, so the round
+	// trip times do not include the sends on the other paths.
+	struct driftsync_packet *packet = &buffer->packet;
+	struct sockaddr_storage server;
+	currentServer(sync, &server);
+
+	for (size_t i = 0; i < sync->pathCount; i++) {
+		struct path *path = &sync->paths[i];
+		lockSync(sync);
+		path->sentRequests++;
+		unlockSync(sync);
+
+		packet->local = localTime();
+		int result = sendto(path->socket, buffer, sizeof(*buffer), 0,
+			(struct sockaddr *)&server, sizeof(server));
+
+		DRIFTSYNC_PROBE(request_send, result, packet->local);
+
+		if (result < 0) {
+			printf("failed to send on path %s: %s\n", path->name,
+				strerror(errno));
+		}
+	}
 }
 
 
-static void *
-receive_loop(void *data)
+static inline int64_t
+saturate(int64_t value, int64_t min, int64_t max)
 {
-	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+	return value < min ? min : value > max ? max : value;
+}
 
-	struct sockaddr_storage peer;
-	socklen_t remoteLength = sizeof(peer);
-	struct driftsync_packet packet;
 
-	while (!sync->quitting) {
-		int result = recvfrom(sync->socket, &packet, sizeof(packet), 0,
-			(struct sockaddr *)&peer, &remoteLength);
-		int64_t now = localTime();
+static void
+encodeTelemetry(struct DRIFTsync *sync, struct driftsync_packet *packet)
+{
+	lockSync(sync);
+	struct driftsync_telemetry telemetry = {
+		.residual = saturate(sync->lastResidual, INT16_MIN, INT16_MAX),
+		.roundTripTime = saturate(sync->roundTripTimes.count > 0
+			? medianRoundTripTime(sync, 1) / 10 : 0, 0, UINT16_MAX),
+		.rejected = (uint16_t)sync->statistics.rejectedSamples,
+		.lost = (uint16_t)(sync->statistics.sentRequests
+			- sync->statistics.receivedSamples)
+	};
+	unlockSync(sync);
+
+	memcpy(&packet->epoch, &telemetry, sizeof(telemetry));
+	packet->flags |= DRIFTSYNC_FLAG_TELEMETRY;
+}
 
-		if (sync->quitting)
-			break;
 
-		if (result < 0) {
-			printf("failed to receive: %s\n", strerror(errno));
-			continue;
-		}
+static void
+sendRequest(struct DRIFTsync *sync, struct driftsync_wall_clock_packet *buffer)
+{
+	struct driftsync_packet *packet = &buffer->packet;
 
-		if (result < (int)sizeof(packet)) {
-			printf("received incomplete packet of %d\n", result);
-			continue;
-		}
+	if (sync->options.telemetry)
+		encodeTelemetry(sync, packet);
 
-		if (packet.magic != DRIFTSYNC_MAGIC) {
-			printf("protocol mismatch\n");
-			continue;
-		}
+	sync->statistics.sentRequests++;
 
-		if ((packet.flags & DRIFTSYNC_FLAG_REPLY) == 0) {
-			printf("received request packet\n");
-			continue;
-		}
+	if (sync->paths != NULL) {
+		sendPathRequests(sync, buffer);
+		return;
+	}
 
-		int64_t measureLocalTime = 0;
-		int64_t measureGlobalTime = 0;
-		if (sync->measureAccuracy) {
-			measureLocalTime = localTime();
-			measureGlobalTime = globalTime(sync);
-		}
+	packet->local = localTime();
+	int result = transmit(sync, buffer, sizeof(*buffer));
 
-		pthread_mutex_lock(&sync->lock);
-		sync->statistics.receivedSamples++;
-
-		int64_t roundTripTime = now - packet.local;
-		ring_buffer_push(&sync->roundTripTimes, &roundTripTime);
-		int64_t difference = roundTripTime - medianRoundTripTime(sync, 1);
-		if ((difference < 0 ? -difference : difference) > 10000) {
-			sync->statistics.rejectedSamples++;
-			pthread_mutex_unlock(&sync->lock);
-			continue;
-		}
+	DRIFTSYNC_PROBE(request_send, result, packet->local);
 
-		struct sample sample = {
-			.local = packet.local,
-			.remote = packet.remote
-		};
+	if (result < 0) {
+		printf("failed to send: %s\n", strerror(errno));
+		return;
+	}
 
-		ring_buffer_push(&sync->samples, &sample);
-		if (sync->samples.count >= 2) {
-			struct sample *first = (struct sample *)ring_buffer_get(
-				&sync->samples, 0);
-			struct sample *last = (struct sample *)ring_buffer_get(
-				&sync->samples, sync->samples.count - 1);
+	if (result != (int)sizeof(*buffer))
+		printf("sent incomplete packet of %d\n", result);
+}
 
-			sync->clockRate = (double)(last->remote - first->remote)
-				/ (last->local - first->local);
-		}
 
-		int64_t offset = packet.remote - packet.local;
-		ring_buffer_push(&sync->offsets, &offset);
+static void
+sendWakeup(struct DRIFTsync *sync)
+{
+	// Not answered by the server and ignored when an old server answers it.
+	struct driftsync_packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.magic = DRIFTSYNC_MAGIC;
+	packet.flags = DRIFTSYNC_FLAG_WAKEUP;
+	packet.local = localTime();
 
-		int64_t total = 0;
-		ring_buffer_apply(&sync->offsets, &sum_int64_t, &total);
+	if (transmit(sync, &packet, sizeof(packet)) < 0) {
+		printf("failed to send wake-up: %s\n", strerror(errno));
+	}
+}
 
-		sync->averageOffset = total / sync->offsets.count;
-		pthread_mutex_unlock(&sync->lock);
 
-		if (sync->measureAccuracy && sync->samples.count > 1) {
-			measureGlobalTime -= globalTime(sync);
-			measureLocalTime -= localTime();
+static void *
+request_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
 
-			pthread_mutex_lock(&sync->lock);
+	struct driftsync_wall_clock_packet buffer;
+	initRequest(&buffer);
 
-			int64_t accuracySample = measureGlobalTime - measureLocalTime;
-			if (accuracySample < 0)
-				accuracySample = -accuracySample;
-			ring_buffer_push(&sync->accuracySamples, &accuracySample);
+	struct timespec wakeupLead = {
+		.tv_sec = sync->options.wakeupLead / 1000000,
+		.tv_nsec = (sync->options.wakeupLead % 1000000) * 1000
+	};
 
-			pthread_cond_broadcast(&sync->condition);
-			pthread_mutex_unlock(&sync->lock);
+	while (!sync->quitting) {
+		if (sync->options.wakeupLead > 0) {
+			sendWakeup(sync);
+			nanosleep(&wakeupLead, NULL);
 		}
+
+		sendRequest(sync, &buffer);
+
+		struct timespec *interval = sync->following
+			? &sync->peerInterval : &sync->interval;
+		if (interval->tv_sec != 0 || interval->tv_nsec != 0)
+			nanosleep(interval, NULL);
 	}
 
 	return NULL;
 }
 
 
-void
-DRIFTsync_quit(struct DRIFTsync *sync)
+static void
+publishRefclock(struct DRIFTsync *sync)
 {
-	pthread_mutex_lock(&sync->lock);
-	sync->quitting = 1;
-	pthread_cond_broadcast(&sync->condition);
-	pthread_mutex_unlock(&sync->lock);
+	// The system clock can only be disciplined to UTC, which the global time
+	// maps to when the server provides its wall clock.
+	if (sync->refclock == NULL || sync->wallClock != DRIFTSYNC_FLAG_WALL_CLOCK)
+		return;
 
-	close(sync->socket);
+	struct timespec system;
+	int64_t local = localTime();
+	clock_gettime(CLOCK_REALTIME, &system);
+	int64_t wallClock = globalTimeAt(sync, local) + sync->wallClockOffset;
+
+	struct ntp_shm_time *shm = sync->refclock;
+	shm->mode = 1;
+	shm->count++;
+	__sync_synchronize();
+
+	shm->clockTimeStampSec = wallClock / 1000000;
+	shm->clockTimeStampUSec = wallClock % 1000000;
+	shm->clockTimeStampNSec = shm->clockTimeStampUSec * 1000;
+	shm->receiveTimeStampSec = system.tv_sec;
+	shm->receiveTimeStampUSec = system.tv_nsec / 1000;
+	shm->receiveTimeStampNSec = system.tv_nsec;
+	shm->leap = 0;
+	shm->precision = -20;
+	shm->nsamples = 0;
+
+	__sync_synchronize();
+	shm->count++;
+	shm->valid = 1;
+}
 
-	pthread_cancel(sync->requestThread);
-	pthread_cancel(sync->receiveThread);
 
-	pthread_join(sync->requestThread, NULL);
-	pthread_join(sync->receiveThread, NULL);
+static void
+clearSamples(struct DRIFTsync *sync)
+{
+	ring_buffer_clear(&sync->roundTripTimes);
+	ring_buffer_clear(&sync->samples);
+	ring_buffer_clear(&sync->offsets);
+	ring_buffer_clear(&sync->acceptedRoundTripTimes);
 
-	ring_buffer_destroy(&sync->roundTripTimes);
-	ring_buffer_destroy(&sync->sortedRoundTripTimes);
+	sync->clockRate = 1.0;
+	sync->averageOffset = 0;
+	sync->lastResidual = 0;
+	sync->lastAccepted = 0;
+	sync->delayBound = 0;
+	sync->residualError = 0;
+	sync->rateStability = DEFAULT_RATE_STABILITY;
+	sync->slewDuration = 0;
+}
+
+
+static void
+flushSamples(struct DRIFTsync *sync)
+{
+	clearSamples(sync);
+	publishEstimate(sync);
+}
+
+
+static void
+updateErrorModel(struct DRIFTsync *sync)
+{
+	// The offsets include the delay of the request, which lies somewhere
+	// within the round trip time of their sample. Their average is covered
+	// by the largest of these round trip times.
+	int64_t maximum = 0;
+	for (size_t i = 0; i < sync->acceptedRoundTripTimes.count; i++) {
+		int64_t roundTripTime
+			= *(int64_t *)ring_buffer_get(&sync->acceptedRoundTripTimes, i);
+		if (roundTripTime > maximum)
+			maximum = roundTripTime;
+	}
+
+	sync->delayBound = maximum;
+
+	// The offsets additionally scatter around their average.
+	double variance = 0;
+	for (size_t i = 0; i < sync->offsets.count; i++) {
+		double deviation = *(int64_t *)ring_buffer_get(&sync->offsets, i)
+			- sync->averageOffset;
+		variance += deviation * deviation / sync->offsets.count;
+	}
+
+	sync->residualError = (int64_t)sqrt(variance);
+
+	// Allan deviation of the clock rate between consecutive samples, the
+	// error bound grows by three times that over the time since the last
+	// accepted sample.
+	if (sync->samples.count < 3) {
+		sync->rateStability = DEFAULT_RATE_STABILITY;
+		return;
+	}
+
+	double sum = 0;
+	double previousRate = 0;
+	size_t rates = 0;
+	for (size_t i = 1; i < sync->samples.count; i++) {
+		struct sample *first = (struct sample *)ring_buffer_get(
+			&sync->samples, i - 1);
+		struct sample *second = (struct sample *)ring_buffer_get(
+			&sync->samples, i);
+		if (second->local == first->local)
+			continue;
+
+		double rate = (double)(second->remote - first->remote)
+			/ (second->local - first->local);
+		if (rates > 0)
+			sum += (rate - previousRate) * (rate - previousRate);
+		previousRate = rate;
+		rates++;
+	}
+
+	sync->rateStability = rates < 2 ? DEFAULT_RATE_STABILITY
+		: 3 * sqrt(sum / (2 * (rates - 1)));
+}
+
+
+static void
+sum_int64_t(void *data, void *state)
+{
+	*(int64_t *)state += *(int64_t *)data;
+}
+
+
+static void
+writeBits(struct archive_block *block, uint64_t value, int count)
+{
+	// Most significant bit first, at most one byte per step.
+	while (count > 0) {
+		int used = block->bits % 8;
+		int take = 8 - used < count ? 8 - used : count;
+		unsigned part = (value >> (count - take)) & ((1u << take) - 1);
+		block->data[block->bits / 8] |= part << (8 - used - take);
+		block->bits += take;
+		count -= take;
+	}
+}
+
+
+static void
+writeDeltaOfDelta(struct archive_block *block, int64_t value)
+{
+	// Buckets sized for microseconds, requests sent at a fixed interval
+	// mostly differ by scheduling jitter.
+	if (value == 0)
+		writeBits(block, 0, 1);
+	else if (value >= -128 && value < 128) {
+		writeBits(block, 2, 2);
+		writeBits(block, (uint64_t)value, 8);
+	} else if (value >= -2048 && value < 2048) {
+		writeBits(block, 6, 3);
+		writeBits(block, (uint64_t)value, 12);
+	} else if (value >= -524288 && value < 524288) {
+		writeBits(block, 14, 4);
+		writeBits(block, (uint64_t)value, 20);
+	} else {
+		writeBits(block, 15, 4);
+		writeBits(block, (uint64_t)value, 64);
+	}
+}
+
+
+static void
+writeXor(struct archive_block *block, struct xor_series *series,
+	uint64_t value)
+{
+	uint64_t difference = value ^ series->value;
+	series->value = value;
+	if (difference == 0) {
+		writeBits(block, 0, 1);
+		return;
+	}
+
+	// Reuses the previous window when the difference fits into it.
+	int leading = __builtin_clzll(difference);
+	int trailing = __builtin_ctzll(difference);
+	if (series->leading >= 0 && leading >= series->leading
+		&& trailing >= series->trailing) {
+		writeBits(block, 2, 2);
+		writeBits(block, difference >> series->trailing,
+			64 - series->leading - series->trailing);
+		return;
+	}
+
+	int length = 64 - leading - trailing;
+	writeBits(block, 3, 2);
+	writeBits(block, leading, 6);
+	writeBits(block, length - 1, 6);
+	writeBits(block, difference >> trailing, length);
+	series->leading = leading;
+	series->trailing = trailing;
+}
+
+
+static void
+resetArchiveState(struct archive_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->offset.leading = -1;
+	state->roundTripTime.leading = -1;
+	state->decision = ARCHIVE_ACCEPTED;
+}
+
+
+static void
+archiveSample(struct sample_archive *archive, int64_t local, int64_t offset,
+	int64_t roundTripTime, int decision)
+{
+	pthread_mutex_lock(&archive->lock);
+
+	struct archive_block *block = archive->count > 0
+		? &archive->blocks[(archive->first + archive->count - 1)
+			% archive->capacity] : NULL;
+	if (block == NULL
+		|| block->bits + ARCHIVE_RECORD_BITS > ARCHIVE_BLOCK_SIZE * 8) {
+		if (archive->count == archive->capacity) {
+			archive->dropped += archive->blocks[archive->first].count;
+			archive->droppedBlocks++;
+			archive->first = (archive->first + 1) % archive->capacity;
+			archive->count--;
+		}
+
+		block = &archive->blocks[(archive->first + archive->count)
+			% archive->capacity];
+		archive->count++;
+		memset(block, 0, sizeof(*block));
+		resetArchiveState(&archive->state);
+	}
+
+	struct archive_state *state = &archive->state;
+	if (block->count == 0) {
+		writeBits(block, (uint64_t)local, 64);
+		block->lowest = local;
+		block->highest = local;
+	} else {
+		int64_t delta = local - state->local;
+		writeDeltaOfDelta(block, delta - state->delta);
+		state->delta = delta;
+	}
+
+	state->local = local;
+	writeXor(block, &state->offset, (uint64_t)offset);
+	writeXor(block, &state->roundTripTime, (uint64_t)roundTripTime);
+
+	if (decision == state->decision)
+		writeBits(block, 0, 1);
+	else {
+		writeBits(block, 4 | decision, 3);
+		state->decision = decision;
+	}
+
+	if (local < block->lowest)
+		block->lowest = local;
+	if (local > block->highest)
+		block->highest = local;
+
+	block->count++;
+	pthread_mutex_unlock(&archive->lock);
+}
+
+
+static void
+processReply(struct DRIFTsync *sync, struct driftsync_wall_clock_packet *buffer,
+	int result, int64_t now)
+{
+	struct driftsync_packet *packet = &buffer->packet;
+
+	if (result < 0) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_RECEIVE, errno);
+		printf("failed to receive: %s\n", strerror(errno));
+		return;
+	}
+
+	if (result < (int)sizeof(*packet)) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_INCOMPLETE, result);
+		printf("received incomplete packet of %d\n", result);
+		return;
+	}
+
+	// Only once the packet is known to contain the times.
+	DRIFTSYNC_PROBE(reply_receive, result, now, packet->local, packet->remote);
+
+	if (packet->magic != DRIFTSYNC_MAGIC) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_MAGIC, packet->magic);
+		printf("protocol mismatch\n");
+		return;
+	}
+
+	if ((packet->flags & DRIFTSYNC_FLAG_REPLY) == 0) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_FLAGS, packet->flags);
+		printf("received request packet\n");
+		return;
+	}
+
+	if ((packet->flags & DRIFTSYNC_FLAG_WAKEUP) != 0) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_WAKEUP, packet->flags);
+		return;
+	}
+
+	int64_t measureLocalTime = 0;
+	int64_t measureGlobalTime = 0;
+	if (sync->measureAccuracy) {
+		measureLocalTime = localTime();
+		measureGlobalTime = globalTime(sync);
+	}
+
+	int decision = ARCHIVE_ACCEPTED;
+	lockSync(sync);
+
+	// Duplicated and reordered replies answer a request that a reply was
+	// already processed for, a duplicate would make for a rate of 0 / 0.
+	// Replies to requests sent before a source switch carry the request
+	// delay of the previous source.
+	if ((int64_t)packet->local <= sync->newestRequest
+		|| (int64_t)packet->local < sync->sourceChange) {
+		DRIFTSYNC_PROBE(reply_drop, DRIFTSYNC_DROP_STALE, packet->local);
+		unlockSync(sync);
+		return;
+	}
+
+	sync->newestRequest = packet->local;
+	sync->statistics.receivedSamples++;
+
+	if (packet->epoch != sync->epoch) {
+		// The server restarted or its clock stepped, nothing collected so
+		// far relates to the new time base anymore.
+		DRIFTSYNC_PROBE(epoch_change, sync->epoch, packet->epoch);
+		if (sync->epoch != 0) {
+			printf("server epoch changed%s, resynchronizing\n",
+				(packet->flags & DRIFTSYNC_FLAG_CLOCK_STEPPED) != 0
+					? " after clock step" : "");
+			sync->statistics.epochChanges++;
+			flushSamples(sync);
+			decision = ARCHIVE_EPOCH_CHANGE;
+		}
+
+		sync->epoch = packet->epoch;
+	}
+
+	// Replies from a different peer leader or the server carry a different
+	// request delay in their offsets, start over but slew to the new source.
+	// The previous estimate stays published until a reply of the new source
+	// is accepted.
+	struct estimate previous = sync->estimate;
+	int switched = 0;
+	if (sync->sourceChanged && previous.lastAccepted != 0) {
+		clearSamples(sync);
+		switched = 1;
+		decision = ARCHIVE_SOURCE_CHANGE;
+	}
+
+	// Servers without wall clock support reply with the basic packet or
+	// without the flag.
+	if (result == (int)sizeof(*buffer)
+		&& (packet->flags & DRIFTSYNC_FLAG_WALL_CLOCK) != 0) {
+		sync->wallClock = packet->flags
+			& (DRIFTSYNC_FLAG_WALL_CLOCK | DRIFTSYNC_FLAG_WALL_CLOCK_TAI);
+		sync->wallClockOffset = buffer->wallClockOffset;
+	} else
+		sync->wallClock = 0;
+
+	int64_t roundTripTime = now - packet->local;
+	ring_buffer_push(&sync->roundTripTimes, &roundTripTime);
+	int64_t median = medianRoundTripTime(sync, 1);
+	int64_t difference = roundTripTime - median;
+	if ((difference < 0 ? -difference : difference) > 10000) {
+		DRIFTSYNC_PROBE(sample_reject, roundTripTime, median);
+		sync->statistics.rejectedSamples++;
+		if (sync->archive != NULL) {
+			archiveSample(sync->archive, packet->local,
+				packet->remote - packet->local, roundTripTime,
+				ARCHIVE_REJECTED);
+		}
+
+		unlockSync(sync);
+		return;
+	}
+
+	int64_t offset = packet->remote - packet->local;
+	DRIFTSYNC_PROBE(sample_accept, roundTripTime, median, offset);
+	sync->sourceChanged = 0;
+	if (sync->archive != NULL) {
+		archiveSample(sync->archive, packet->local, offset, roundTripTime,
+			decision);
+	}
+
+	int holdover = switched || (sync->lastAccepted != 0
+		&& now - sync->lastAccepted > sync->holdoverTimeout);
+	int64_t holdoverTime = holdover ? estimateTime(&previous, now) : 0;
+
+	struct sample sample = {
+		.local = packet->local,
+		.remote = packet->remote
+	};
+
+	ring_buffer_push(&sync->samples, &sample);
+	if (sync->samples.count >= 2) {
+		struct sample *first = (struct sample *)ring_buffer_get(
+			&sync->samples, 0);
+		struct sample *last = (struct sample *)ring_buffer_get(
+			&sync->samples, sync->samples.count - 1);
+
+		if (last->local != first->local) {
+			sync->clockRate = (double)(last->remote - first->remote)
+				/ (last->local - first->local);
+		}
+	}
+
+	ring_buffer_push(&sync->offsets, &offset);
+	ring_buffer_push(&sync->acceptedRoundTripTimes, &roundTripTime);
+
+	int64_t total = 0;
+	ring_buffer_apply(&sync->offsets, &sum_int64_t, &total);
+
+	sync->averageOffset = total / sync->offsets.count;
+	sync->lastResidual = offset - sync->averageOffset;
+	sync->lastAccepted = now;
+	updateErrorModel(sync);
+
+	if (holdover) {
+		// Slew from the extrapolated time to the new estimate instead of
+		// stepping to it, after holdover or when switching sources.
+		sync->slewDuration = 0;
+		publishEstimate(sync);
+		sync->slewOffset = holdoverTime - globalTimeAt(sync, now);
+		sync->slewStart = now;
+		sync->slewDuration = (int64_t)((sync->slewOffset < 0
+			? -sync->slewOffset : sync->slewOffset) / MAX_SLEW_RATE);
+	}
+
+	publishEstimate(sync);
+
+	DRIFTSYNC_PROBE(estimator_update, sync->averageOffset,
+		(int64_t)((sync->clockRate - 1) * 1000 * 1000 * 1000),
+		sync->samples.count);
+
+	publishRefclock(sync);
+	unlockSync(sync);
+
+	if (sync->measureAccuracy && sync->samples.count > 1) {
+		measureGlobalTime -= globalTime(sync);
+		measureLocalTime -= localTime();
+
+		lockSync(sync);
+
+		int64_t accuracySample = measureGlobalTime - measureLocalTime;
+		if (accuracySample < 0)
+			accuracySample = -accuracySample;
+		ring_buffer_push(&sync->accuracySamples, &accuracySample);
+		DRIFTSYNC_PROBE(accuracy, accuracySample);
+
+		pthread_cond_broadcast(&sync->condition);
+		unlockSync(sync);
+	}
+}
+
+
+static void
+servePeer(struct DRIFTsync *sync, struct driftsync_wall_clock_packet *buffer,
+	int result, struct sockaddr_storage *peer, socklen_t peerLength,
+	int64_t now)
+{
+	// The leader answers requests of its followers like the server would, but
+	// with its global time, so followers end up on the server time base. Like
+	// the server it stamps the time the request was received.
+	struct driftsync_packet *packet = &buffer->packet;
+	if (sync->following || (packet->flags & DRIFTSYNC_FLAG_WAKEUP) != 0)
+		return;
+
+	struct estimate estimate;
+	readEstimate(sync, &estimate);
+	int64_t remote = estimateTime(&estimate, now);
+	if (remote == 0)
+		return;
+
+	packet->remote = remote;
+	packet->epoch = sync->epoch;
+	packet->flags = DRIFTSYNC_FLAG_REPLY;
+
+	uint32_t wallClock = sync->wallClock;
+	if (result == (int)sizeof(*buffer) && wallClock != 0) {
+		packet->flags |= wallClock;
+		buffer->wallClockOffset = sync->wallClockOffset;
+	} else
+		result = sizeof(*packet);
+
+	if (sendto(sync->socket, buffer, result, 0, (struct sockaddr *)peer,
+			peerLength) < 0) {
+		printf("failed to send peer reply: %s\n", strerror(errno));
+		return;
+	}
+
+	lockSync(sync);
+	sync->statistics.servedRequests++;
+	unlockSync(sync);
+}
+
+
+static void *
+receive_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+
+	struct sockaddr_storage peer;
+	struct driftsync_wall_clock_packet buffer;
+
+	while (!sync->quitting) {
+		socklen_t remoteLength = sizeof(peer);
+		int result = recvfrom(sync->socket, &buffer, sizeof(buffer), 0,
+			(struct sockaddr *)&peer, &remoteLength);
+		int64_t now = localTime();
+
+		if (sync->quitting)
+			break;
+
+		// In peer mode, followers send their requests to the same socket.
+		if (sync->peers != NULL && result >= (int)sizeof(buffer.packet)
+			&& buffer.packet.magic == DRIFTSYNC_MAGIC
+			&& (buffer.packet.flags & DRIFTSYNC_FLAG_REPLY) == 0) {
+			servePeer(sync, &buffer, result, &peer, remoteLength, now);
+			continue;
+		}
+
+		processReply(sync, &buffer, result, now);
+	}
+
+	return NULL;
+}
+
+
+static void *
+transport_receive_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+	const struct transport *transport = sync->options.transport;
+
+	struct driftsync_wall_clock_packet buffer;
+
+	while (!sync->quitting) {
+		double arrival = 0;
+		int result = transport->receive(transport->context, &buffer,
+			sizeof(buffer), &arrival);
+		int64_t now = arrival > 0 ? (int64_t)(arrival / sync->scale)
+			: localTime();
+
+		if (sync->quitting)
+			break;
+
+		processReply(sync, &buffer, result, now);
+	}
+
+	return NULL;
+}
+
+
+static void
+pathQuality(struct path *path, int64_t *roundTripTime, double *offset,
+	double *deviation)
+{
+	int64_t sorted[PATH_SAMPLES];
+	size_t count = path->roundTripTimes.count;
+	for (size_t i = 0; i < count; i++)
+		sorted[i] = *(int64_t *)ring_buffer_get(&path->roundTripTimes, i);
+
+	qsort(sorted, count, sizeof(int64_t), compare_int64_t);
+	*roundTripTime = count > 0 ? sorted[count / 2] : 0;
+
+	double sum = 0;
+	for (size_t i = 0; i < path->offsets.count; i++)
+		sum += *(int64_t *)ring_buffer_get(&path->offsets, i);
+
+	*offset = path->offsets.count > 0 ? sum / path->offsets.count : 0;
+
+	double variance = 0;
+	for (size_t i = 0; i < path->offsets.count; i++) {
+		double difference = *(int64_t *)ring_buffer_get(&path->offsets, i)
+			- *offset;
+		variance += difference * difference / path->offsets.count;
+	}
+
+	*deviation = sqrt(variance);
+}
+
+
+static void
+selectPath(struct DRIFTsync *sync, int64_t now)
+{
+	// Paths are scored by their typical round trip time plus the spread of
+	// their offsets, the error they would contribute to the estimate. Paths
+	// without recent replies are down.
+	size_t best = sync->pathCount;
+	double bestScore = 0;
+	double activeScore = -1;
+	size_t minimum = sync->activePath < sync->pathCount ? PATH_MIN_SAMPLES : 1;
+
+	for (size_t i = 0; i < sync->pathCount; i++) {
+		struct path *path = &sync->paths[i];
+		if (path->lastReceived == 0
+			|| now - path->lastReceived > sync->holdoverTimeout)
+			continue;
+
+		if (i != sync->activePath && path->roundTripTimes.count < minimum)
+			continue;
+
+		int64_t roundTripTime;
+		double offset;
+		double deviation;
+		pathQuality(path, &roundTripTime, &offset, &deviation);
+
+		double score = roundTripTime + 2 * deviation;
+		if (i == sync->activePath)
+			activeScore = score;
+
+		if (best == sync->pathCount || score < bestScore) {
+			best = i;
+			bestScore = score;
+		}
+	}
+
+	if (best == sync->pathCount || best == sync->activePath)
+		return;
+
+	if (activeScore >= 0 && bestScore > activeScore * PATH_HYSTERESIS)
+		return;
+
+	// The estimator starts over on the new path but slews to it like after
+	// a change of the peer leader.
+	if (sync->activePath < sync->pathCount) {
+		printf("switching from path %s to %s\n",
+			sync->paths[sync->activePath].name, sync->paths[best].name);
+		sync->sourceChanged = 1;
+		sync->sourceChange = now;
+	}
+
+	sync->activePath = best;
+}
+
+
+static void
+processPathReply(struct DRIFTsync *sync, size_t index,
+	struct driftsync_wall_clock_packet *buffer, int result, int64_t now)
+{
+	struct driftsync_packet *packet = &buffer->packet;
+	if (result < (int)sizeof(*packet) || packet->magic != DRIFTSYNC_MAGIC
+		|| (packet->flags & DRIFTSYNC_FLAG_REPLY) == 0
+		|| (packet->flags & DRIFTSYNC_FLAG_WAKEUP) != 0) {
+		// Reported and dropped there.
+		processReply(sync, buffer, result, now);
+		return;
+	}
+
+	lockSync(sync);
+
+	struct path *path = &sync->paths[index];
+	if (packet->epoch != path->epoch) {
+		ring_buffer_clear(&path->offsets);
+		path->epoch = packet->epoch;
+	}
+
+	int64_t roundTripTime = now - packet->local;
+	ring_buffer_push(&path->roundTripTimes, &roundTripTime);
+
+	// Measured against the estimate, which removes the drift of the local
+	// clock from the spread of the offsets.
+	if (sync->lastAccepted != 0 && packet->epoch == sync->epoch) {
+		int64_t offset = packet->remote
+			- globalTimeAt(sync, packet->local + roundTripTime / 2);
+		ring_buffer_push(&path->offsets, &offset);
+	}
+
+	path->receivedSamples++;
+	path->lastReceived = now;
+
+	selectPath(sync, now);
+	int active = index == sync->activePath;
+	unlockSync(sync);
+
+	if (active)
+		processReply(sync, buffer, result, now);
+}
+
+
+static void *
+multipath_receive_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+
+	struct pollfd sockets[MAX_PATHS];
+	for (size_t i = 0; i < sync->pathCount; i++) {
+		sockets[i].fd = sync->paths[i].socket;
+		sockets[i].events = POLLIN;
+	}
+
+	struct driftsync_wall_clock_packet buffer;
+
+	while (!sync->quitting) {
+		int result = poll(sockets, sync->pathCount, -1);
+
+		// All replies pending on wake-up arrived before it, taking the time
+		// once keeps the paths read last from looking slower.
+		int64_t now = localTime();
+
+		if (sync->quitting)
+			break;
+
+		if (result < 0) {
+			if (errno != EINTR)
+				printf("failed to poll paths: %s\n", strerror(errno));
+			continue;
+		}
+
+		for (size_t i = 0; i < sync->pathCount; i++) {
+			if ((sockets[i].revents & POLLIN) == 0)
+				continue;
+
+			result = recv(sockets[i].fd, &buffer, sizeof(buffer), 0);
+			processPathReply(sync, i, &buffer, result, now);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void *
+ticker_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	while (!sync->quitting) {
+		int64_t now = localTime();
+		__atomic_store_n(&sync->coarse->time, globalTime(sync),
+			__ATOMIC_RELAXED);
+		__atomic_store_n(&sync->coarse->lag,
+			now - ((int64_t)deadline.tv_sec * 1000 * 1000
+				+ deadline.tv_nsec / 1000), __ATOMIC_RELAXED);
+
+		deadline.tv_nsec += sync->options.coarseInterval * 1000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	}
+
+	return NULL;
+}
+
+
+static void
+announcePeer(struct DRIFTsync *sync)
+{
+	struct driftsync_packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.magic = DRIFTSYNC_MAGIC;
+	packet.flags = DRIFTSYNC_FLAG_ANNOUNCE;
+	packet.local = sync->peerId;
+	packet.remote = sync->servicePort;
+	packet.epoch = sync->lastAccepted != 0 ? sync->epoch : 0;
+
+	struct sockaddr_in broadcast;
+	memset(&broadcast, 0, sizeof(broadcast));
+	broadcast.sin_family = AF_INET;
+	broadcast.sin_port = htons(sync->options.peerPort);
+	broadcast.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+	if (sendto(sync->peerSocket, &packet, sizeof(packet), 0,
+			(struct sockaddr *)&broadcast, sizeof(broadcast)) < 0) {
+		printf("failed to send peer announcement: %s\n", strerror(errno));
+	}
+}
+
+
+static void
+recordPeer(struct DRIFTsync *sync, struct driftsync_packet *packet,
+	struct sockaddr_in *address, int64_t now)
+{
+	if (packet->local == sync->peerId)
+		return;
+
+	// Replaces the least recently seen entry when the table is full.
+	struct peer *entry = &sync->peers[0];
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		if (sync->peers[i].id == packet->local) {
+			entry = &sync->peers[i];
+			break;
+		}
+
+		if (sync->peers[i].lastSeen < entry->lastSeen)
+			entry = &sync->peers[i];
+	}
+
+	entry->id = packet->local;
+	entry->epoch = packet->epoch;
+	entry->address = *address;
+	entry->address.sin_port = htons((uint16_t)packet->remote);
+	entry->lastSeen = now;
+}
+
+
+static void
+electLeader(struct DRIFTsync *sync, int64_t now)
+{
+	// The synchronized node with the lowest id leads. Unsynchronized nodes
+	// only lead themselves until they hear of a synchronized one, so that a
+	// joining node does not take over before it has the same time base.
+	struct peer *leader = NULL;
+	uint64_t leaderId = sync->lastAccepted != 0 ? sync->peerId : UINT64_MAX;
+	for (size_t i = 0; i < PEER_TABLE_SIZE; i++) {
+		struct peer *peer = &sync->peers[i];
+		if (peer->lastSeen == 0 || now - peer->lastSeen > PEER_TIMEOUT
+			|| peer->epoch == 0 || peer->id >= leaderId) {
+			continue;
+		}
+
+		leader = peer;
+		leaderId = peer->id;
+	}
+
+	if (leader == NULL)
+		leaderId = sync->peerId;
+
+	if (leaderId == sync->leaderId)
+		return;
+
+	lockSync(sync);
+	sync->leaderId = leaderId;
+	sync->following = leader != NULL;
+	sync->sourceChanged = 1;
+	sync->sourceChange = now;
+	if (leader != NULL) {
+		memset(&sync->server, 0, sizeof(sync->server));
+		memcpy(&sync->server, &leader->address, sizeof(leader->address));
+	} else
+		memcpy(&sync->server, &sync->upstream, sizeof(sync->server));
+	unlockSync(sync);
+
+	if (leader != NULL) {
+		printf("following peer leader %s:%u\n",
+			inet_ntoa(leader->address.sin_addr),
+			ntohs(leader->address.sin_port));
+	} else
+		printf("leading peers, synchronizing to the server\n");
+}
+
+
+static void *
+peer_loop(void *data)
+{
+	struct DRIFTsync *sync = (struct DRIFTsync *)data;
+
+	struct driftsync_packet packet;
+	struct sockaddr_in address;
+	int64_t nextAnnouncement = 0;
+
+	while (!sync->quitting) {
+		// The socket has a receive timeout of the announcement interval.
+		socklen_t addressLength = sizeof(address);
+		int result = recvfrom(sync->peerSocket, &packet, sizeof(packet), 0,
+			(struct sockaddr *)&address, &addressLength);
+		int64_t now = localTime();
+
+		if (sync->quitting)
+			break;
+
+		if (result == (int)sizeof(packet) && packet.magic == DRIFTSYNC_MAGIC
+			&& (packet.flags & DRIFTSYNC_FLAG_ANNOUNCE) != 0
+			&& address.sin_family == AF_INET) {
+			recordPeer(sync, &packet, &address, now);
+		}
+
+		if (now >= nextAnnouncement) {
+			announcePeer(sync);
+			electLeader(sync, now);
+			nextAnnouncement = now + PEER_ANNOUNCE_INTERVAL;
+		}
+	}
+
+	return NULL;
+}
+
+
+static uint64_t
+randomPeerId()
+{
+	uint64_t result = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &result, sizeof(result)) != sizeof(result))
+			result = 0;
+		close(fd);
+	}
+
+	if (result == 0)
+		result = ((uint64_t)localTime() << 16) ^ getpid();
+
+	return result;
+}
+
+
+static int
+openPeerSocket(struct DRIFTsync *sync)
+{
+	// Bind the request socket to a known port the followers can reach.
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	socklen_t addressLength = sizeof(address);
+	if (bind(sync->socket, (struct sockaddr *)&address, sizeof(address)) != 0
+		|| getsockname(sync->socket, (struct sockaddr *)&address,
+			&addressLength) != 0) {
+		printf("failed to bind socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	sync->servicePort = ntohs(address.sin_port);
+
+	sync->peerSocket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sync->peerSocket < 0) {
+		printf("failed to create peer socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// All clients on a host share the announcement port.
+	int enable = 1;
+	struct timeval timeout = {
+		.tv_sec = PEER_ANNOUNCE_INTERVAL / 1000000,
+		.tv_usec = PEER_ANNOUNCE_INTERVAL % 1000000
+	};
+
+	address.sin_port = htons(sync->options.peerPort);
+	if (setsockopt(sync->peerSocket, SOL_SOCKET, SO_REUSEADDR, &enable,
+			sizeof(enable)) != 0
+		|| setsockopt(sync->peerSocket, SOL_SOCKET, SO_BROADCAST, &enable,
+			sizeof(enable)) != 0
+		|| setsockopt(sync->peerSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			sizeof(timeout)) != 0
+		|| bind(sync->peerSocket, (struct sockaddr *)&address,
+			sizeof(address)) != 0) {
+		printf("failed to set up peer socket: %s\n", strerror(errno));
+		close(sync->peerSocket);
+		return -1;
+	}
+
+	sync->peers = (struct peer *)calloc(PEER_TABLE_SIZE, sizeof(struct peer));
+	if (sync->peers == NULL) {
+		printf("out of memory allocating peer table\n");
+		close(sync->peerSocket);
+		return -1;
+	}
+
+	sync->peerId = randomPeerId();
+	sync->leaderId = sync->peerId;
+	return 0;
+}
+
+
+static void
+closePaths(struct DRIFTsync *sync)
+{
+	for (size_t i = 0; i < sync->pathCount; i++) {
+		close(sync->paths[i].socket);
+		ring_buffer_destroy(&sync->paths[i].roundTripTimes);
+		ring_buffer_destroy(&sync->paths[i].offsets);
+	}
+
+	free(sync->paths);
+	sync->paths = NULL;
+	sync->pathCount = 0;
+}
+
+
+void
+DRIFTsync_quit(struct DRIFTsync *sync)
+{
+	pthread_mutex_lock(&sync->lock);
+	sync->quitting = 1;
+	pthread_cond_broadcast(&sync->condition);
+	pthread_mutex_unlock(&sync->lock);
+
+	if (sync->socket >= 0)
+		close(sync->socket);
+	if (sync->peers != NULL)
+		close(sync->peerSocket);
+
+	if (!sync->options.polled) {
+		pthread_cancel(sync->requestThread);
+		pthread_join(sync->requestThread, NULL);
+
+		if (sync->receiving) {
+			pthread_cancel(sync->receiveThread);
+			pthread_join(sync->receiveThread, NULL);
+		}
+
+		if (sync->coarse != NULL) {
+			pthread_cancel(sync->tickerThread);
+			pthread_join(sync->tickerThread, NULL);
+		}
+
+		if (sync->peers != NULL) {
+			pthread_cancel(sync->peerThread);
+			pthread_join(sync->peerThread, NULL);
+		}
+	}
+
+	free(sync->coarse);
+	free(sync->peers);
+	closePaths(sync);
+
+	ring_buffer_destroy(&sync->roundTripTimes);
+	ring_buffer_destroy(&sync->sortedRoundTripTimes);
 	ring_buffer_destroy(&sync->samples);
 	ring_buffer_destroy(&sync->offsets);
+	ring_buffer_destroy(&sync->acceptedRoundTripTimes);
 	ring_buffer_destroy(&sync->accuracySamples);
 
-	pthread_cond_destroy(&sync->condition);
-	pthread_mutex_destroy(&sync->lock);
+	if (sync->refclock != NULL)
+		shmdt(sync->refclock);
+
+	pthread_cond_destroy(&sync->condition);
+	pthread_mutex_destroy(&sync->lock);
+
+	free(sync);
+}
+
+
+static void
+applySocketOptions(struct DRIFTsync *sync, int socket)
+{
+	// All of these are optimizations, failing to apply them is non-fatal.
+	if (sync->options.dscp >= 0) {
+		int tos = sync->options.dscp << 2;
+		if (setsockopt(socket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) != 0) {
+			printf("failed to set type of service socket option: %s\n",
+				strerror(errno));
+		}
+	}
+
+#ifdef SO_PRIORITY
+	if (sync->options.socketPriority >= 0) {
+		if (setsockopt(socket, SOL_SOCKET, SO_PRIORITY,
+				&sync->options.socketPriority,
+				sizeof(sync->options.socketPriority)) != 0) {
+			printf("failed to set priority socket option: %s\n",
+				strerror(errno));
+		}
+	}
+#endif
+
+#ifdef SO_BUSY_POLL
+	if (sync->options.busyPoll > 0) {
+		if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL,
+				&sync->options.busyPoll, sizeof(sync->options.busyPoll)) != 0) {
+			printf("failed to set busy poll socket option: %s\n",
+				strerror(errno));
+		}
+	}
+#endif
+}
+
+
+static void
+applyThreadOptions(struct DRIFTsync *sync, pthread_t thread)
+{
+	// Keeps the receive thread from being delayed by application threads
+	// between the packet arriving and it being timestamped.
+	if (sync->options.realtimePriority > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sync->options.realtimePriority;
+		int result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+		if (result != 0) {
+			printf("failed to set realtime priority: %s\n",
+				strerror(result));
+		}
+	}
+
+#ifdef CPU_SET
+	if (sync->options.cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(sync->options.cpu, &set);
+		int result = pthread_setaffinity_np(thread, sizeof(set), &set);
+		if (result != 0)
+			printf("failed to set cpu affinity: %s\n", strerror(result));
+	}
+#endif
+}
+
+
+void
+DRIFTsync_defaultOptions(struct options *options)
+{
+	options->realtimePriority = 0;
+	options->cpu = -1;
+	options->busyPoll = 0;
+	options->dscp = -1;
+	options->socketPriority = -1;
+	options->refclockUnit = -1;
+	options->coarseInterval = 0;
+	options->polled = 0;
+	options->wakeupLead = 0;
+	options->peerPort = 0;
+	options->peerInterval = 1000 * 1000;
+	options->transport = NULL;
+	options->telemetry = 0;
+	options->paths = NULL;
+}
+
+
+static struct ntp_shm_time *
+attachRefclock(int unit)
+{
+	// Units 0 and 1 are by convention only accessible to root.
+	int shm = shmget(NTP_SHM_KEY + unit, sizeof(struct ntp_shm_time),
+		IPC_CREAT | (unit < 2 ? 0600 : 0666));
+	if (shm < 0) {
+		printf("failed to get refclock shared memory: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	void *address = shmat(shm, NULL, 0);
+	if (address == (void *)-1) {
+		printf("failed to attach refclock shared memory: %s\n",
+			strerror(errno));
+		return NULL;
+	}
+
+	return (struct ntp_shm_time *)address;
+}
+
+
+static int
+openSocket(struct DRIFTsync *sync, const char *server, uint16_t port)
+{
+	sync->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sync->socket < 0) {
+		printf("failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	char service[10];
+	snprintf(service, sizeof(service), "%u", port);
+
+	struct addrinfo *addressInfo;
+	int result = getaddrinfo(server, service, NULL, &addressInfo);
+	if (result != 0 || addressInfo == NULL) {
+		printf("failed to resolve host \"%s\": %s\n", server,
+			gai_strerror(result));
+		close(sync->socket);
+		return -1;
+	}
+
+	memset(&sync->server, 0, sizeof(sync->server));
+	memcpy(&sync->server, addressInfo->ai_addr, addressInfo->ai_addrlen);
+	memcpy(&sync->upstream, &sync->server, sizeof(sync->upstream));
+	freeaddrinfo(addressInfo);
+
+	applySocketOptions(sync, sync->socket);
+
+	if (sync->options.polled) {
+		int flags = fcntl(sync->socket, F_GETFL);
+		if (flags < 0
+			|| fcntl(sync->socket, F_SETFL, flags | O_NONBLOCK) != 0) {
+			printf("failed to make socket non-blocking: %s\n",
+				strerror(errno));
+			close(sync->socket);
+			return -1;
+		}
+
+#ifdef SO_TIMESTAMPNS
+		int timestamps = 1;
+		if (setsockopt(sync->socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps,
+				sizeof(timestamps)) != 0) {
+			printf("failed to enable receive timestamps: %s\n",
+				strerror(errno));
+			// non-fatal
+		}
+#endif
+	}
+
+	return 0;
+}
+
+
+static int
+openPath(struct DRIFTsync *sync, struct path *path)
+{
+	path->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (path->socket < 0) {
+		printf("failed to create socket for path %s: %s\n", path->name,
+			strerror(errno));
+		return -1;
+	}
+
+	// Local addresses are bound to, anything else names an interface.
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	if (inet_pton(AF_INET, path->name, &local.sin_addr) == 1) {
+		if (bind(path->socket, (struct sockaddr *)&local, sizeof(local))
+				!= 0) {
+			printf("failed to bind to address %s: %s\n", path->name,
+				strerror(errno));
+			close(path->socket);
+			return -1;
+		}
+	} else {
+#ifdef SO_BINDTODEVICE
+		if (setsockopt(path->socket, SOL_SOCKET, SO_BINDTODEVICE, path->name,
+				strlen(path->name)) != 0) {
+			printf("failed to bind to interface %s: %s\n", path->name,
+				strerror(errno));
+			close(path->socket);
+			return -1;
+		}
+#else
+		printf("binding to interface %s is not supported\n", path->name);
+		close(path->socket);
+		return -1;
+#endif
+	}
+
+	applySocketOptions(sync, path->socket);
+
+	ring_buffer_init(&path->roundTripTimes, PATH_SAMPLES, sizeof(int64_t));
+	ring_buffer_init(&path->offsets, PATH_SAMPLES, sizeof(int64_t));
+	path->epoch = 0;
+	path->sentRequests = 0;
+	path->receivedSamples = 0;
+	path->lastReceived = 0;
+	return 0;
+}
+
+
+static int
+openPaths(struct DRIFTsync *sync)
+{
+	sync->paths = (struct path *)malloc(MAX_PATHS * sizeof(struct path));
+	if (sync->paths == NULL) {
+		printf("out of memory allocating paths\n");
+		return -1;
+	}
+
+	const char *name = sync->options.paths;
+	while (*name != '\0') {
+		size_t length = strcspn(name, ",");
+		struct path *path = &sync->paths[sync->pathCount];
+		if (sync->pathCount == MAX_PATHS || length == 0
+			|| length >= sizeof(path->name)) {
+			printf("invalid paths \"%s\", at most %d are supported\n",
+				sync->options.paths, MAX_PATHS);
+			closePaths(sync);
+			return -1;
+		}
+
+		memcpy(path->name, name, length);
+		path->name[length] = '\0';
+		if (openPath(sync, path) != 0) {
+			closePaths(sync);
+			return -1;
+		}
+
+		sync->pathCount++;
+		name += length;
+		if (*name == ',')
+			name++;
+	}
+
+	if (sync->pathCount == 0) {
+		printf("no paths given\n");
+		closePaths(sync);
+		return -1;
+	}
+
+	// Requests only go out on the paths, which also receive the replies.
+	close(sync->socket);
+	sync->socket = -1;
+	sync->activePath = sync->pathCount;
+	return 0;
+}
+
+
+struct DRIFTsync *
+DRIFTsync_createWithOptions(const char *server, uint16_t port, double scale,
+	int interval, int measureAccuracy, const struct options *options)
+{
+	struct DRIFTsync *sync
+		= (struct DRIFTsync *)malloc(sizeof(struct DRIFTsync));
+	if (sync == NULL) {
+		printf("out of memory allocating sync struct\n");
+		return NULL;
+	}
+
+	if (options != NULL)
+		sync->options = *options;
+	else
+		DRIFTsync_defaultOptions(&sync->options);
+
+	sync->socket = -1;
+	if (sync->options.transport == NULL
+		&& openSocket(sync, server, port) != 0) {
+		free(sync);
+		return NULL;
+	}
+
+	sync->coarse = NULL;
+	if (sync->options.coarseInterval > 0) {
+		sync->coarse = (struct coarse_time *)aligned_alloc(
+			sizeof(struct coarse_time), sizeof(struct coarse_time));
+		if (sync->coarse == NULL) {
+			printf("out of memory allocating coarse time\n");
+			if (sync->socket >= 0)
+				close(sync->socket);
+			free(sync);
+			return NULL;
+		}
+
+		memset(sync->coarse, 0, sizeof(struct coarse_time));
+	}
+
+	sync->refclock = NULL;
+	if (sync->options.refclockUnit >= 0) {
+		sync->refclock = attachRefclock(sync->options.refclockUnit);
+		if (sync->refclock == NULL) {
+			printf("not publishing to refclock unit %d\n",
+				sync->options.refclockUnit);
+			// non-fatal
+		}
+	}
+
+	sync->archive = NULL;
+	sync->peers = NULL;
+	sync->following = 0;
+	sync->sourceChanged = 0;
+	sync->sourceChange = 0;
+	if (sync->options.peerPort > 0
+		&& (sync->options.polled || sync->options.transport != NULL)) {
+		printf("peer mode is not available in polled mode or with a"
+			" transport\n");
+		// non-fatal
+	} else if (sync->options.peerPort > 0 && openPeerSocket(sync) != 0) {
+		close(sync->socket);
+		free(sync->coarse);
+		if (sync->refclock != NULL)
+			shmdt(sync->refclock);
+		free(sync);
+		return NULL;
+	}
+
+	sync->paths = NULL;
+	sync->pathCount = 0;
+	sync->activePath = 0;
+	if (sync->options.paths != NULL && (sync->options.polled
+			|| sync->options.transport != NULL || sync->peers != NULL)) {
+		printf("multiple paths are not available in polled mode, with a"
+			" transport or in peer mode\n");
+		// non-fatal
+	} else if (sync->options.paths != NULL && openPaths(sync) != 0) {
+		close(sync->socket);
+		free(sync->coarse);
+		if (sync->refclock != NULL)
+			shmdt(sync->refclock);
+		free(sync);
+		return NULL;
+	}
+
+	pthread_mutex_init(&sync->lock, NULL);
+	pthread_cond_init(&sync->condition, NULL);
+
+	sync->maxSamples = 10;
+	sync->clockRate = 1.0;
+	sync->averageOffset = 0;
+	sync->lastResidual = 0;
+	sync->lastAccepted = 0;
+	sync->newestRequest = 0;
+	sync->delayBound = 0;
+	sync->residualError = 0;
+	sync->rateStability = DEFAULT_RATE_STABILITY;
+	sync->slewOffset = 0;
+	sync->slewStart = 0;
+	sync->slewDuration = 0;
+	sync->generation = 0;
+	sync->historyCount = 0;
+	sync->historyPosition = ESTIMATE_HISTORY - 1;
+	sync->epoch = 0;
+	sync->wallClock = 0;
+	sync->wallClockOffset = 0;
+	memset(&sync->statistics, 0, sizeof(struct statistics));
+
+	ring_buffer_init(&sync->roundTripTimes, sync->maxSamples, sizeof(int64_t));
+	ring_buffer_init(&sync->sortedRoundTripTimes, sync->maxSamples,
+		sizeof(int64_t));
+	ring_buffer_init(&sync->samples, sync->maxSamples, sizeof(struct sample));
+	ring_buffer_init(&sync->offsets, sync->maxSamples, sizeof(int64_t));
+	ring_buffer_init(&sync->acceptedRoundTripTimes, sync->maxSamples,
+		sizeof(int64_t));
+	ring_buffer_init(&sync->accuracySamples, sync->maxSamples, sizeof(int64_t));
+	publishEstimate(sync);
+
+	sync->interval.tv_sec = interval / 1000000;
+	sync->interval.tv_nsec = (interval % 1000000) * 1000;
+	sync->peerInterval.tv_sec = sync->options.peerInterval / 1000000;
+	sync->peerInterval.tv_nsec = (sync->options.peerInterval % 1000000) * 1000;
+
+	sync->holdoverTimeout = (int64_t)interval * HOLDOVER_INTERVALS;
+	if (sync->holdoverTimeout < 1000 * 1000)
+		sync->holdoverTimeout = 1000 * 1000;
+
+	sync->scale = scale;
+	sync->measureAccuracy = measureAccuracy;
+	sync->quitting = 0;
+
+	sync->nextRequest = localTime() + sync->options.wakeupLead;
+	sync->wakeupSent = 0;
+	initRequest(&sync->request);
+
+	sync->receiving = 0;
+	if (sync->options.polled)
+		return sync;
+
+	if (sync->paths != NULL) {
+		pthread_create(&sync->receiveThread, NULL, &multipath_receive_loop,
+			sync);
+		sync->receiving = 1;
+	} else if (sync->options.transport == NULL) {
+		pthread_create(&sync->receiveThread, NULL, &receive_loop, sync);
+		sync->receiving = 1;
+	} else if (sync->options.transport->receive != NULL) {
+		pthread_create(&sync->receiveThread, NULL, &transport_receive_loop,
+			sync);
+		sync->receiving = 1;
+	}
+
+	pthread_create(&sync->requestThread, NULL, &request_loop, sync);
+	if (sync->coarse != NULL)
+		pthread_create(&sync->tickerThread, NULL, &ticker_loop, sync);
+	if (sync->peers != NULL)
+		pthread_create(&sync->peerThread, NULL, &peer_loop, sync);
+
+	if (sync->receiving)
+		applyThreadOptions(sync, sync->receiveThread);
+	return sync;
+}
+
+
+struct DRIFTsync *
+DRIFTsync_create(const char *server, uint16_t port, double scale, int interval,
+	int measureAccuracy)
+{
+	return DRIFTsync_createWithOptions(server, port, scale, interval,
+		measureAccuracy, NULL);
+}
+
+
+double
+DRIFTsync_poll(struct DRIFTsync *sync, double now)
+{
+	// Single threaded operation for applications with their own main loop,
+	// sends a request when one is due and processes all pending replies.
+	int64_t local = (int64_t)(now / sync->scale);
+	if (sync->options.wakeupLead > 0 && !sync->wakeupSent
+		&& local >= sync->nextRequest - sync->options.wakeupLead) {
+		sendWakeup(sync);
+		sync->wakeupSent = 1;
+	}
+
+	if (local >= sync->nextRequest) {
+		sendRequest(sync, &sync->request);
+		sync->wakeupSent = 0;
+
+		int64_t interval = (int64_t)sync->interval.tv_sec * 1000 * 1000
+			+ sync->interval.tv_nsec / 1000;
+		sync->nextRequest += interval;
+		if (sync->nextRequest <= local)
+			sync->nextRequest = local + interval;
+	}
+
+	struct driftsync_wall_clock_packet buffer;
+	struct iovec vector = {
+		.iov_base = &buffer,
+		.iov_len = sizeof(buffer)
+	};
+
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct msghdr message;
+
+	// With a transport, replies are handed over through DRIFTsync_deliver.
+	while (sync->socket >= 0) {
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		int result = recvmsg(sync->socket, &message, 0);
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		// Replies may have been waiting for the next call for a while, so the
+		// kernel receive timestamp is used to get the actual arrival time.
+		int64_t now = localTime();
+#ifdef SCM_TIMESTAMPNS
+		struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+		if (result >= 0 && header != NULL && header->cmsg_level == SOL_SOCKET
+			&& header->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec received;
+			struct timespec system;
+			memcpy(&received, CMSG_DATA(header), sizeof(received));
+			clock_gettime(CLOCK_REALTIME, &system);
+			now -= (int64_t)(system.tv_sec - received.tv_sec) * 1000 * 1000
+				+ (system.tv_nsec - received.tv_nsec) / 1000;
+		}
+#endif
+
+		processReply(sync, &buffer, result, now);
+		if (result < 0)
+			break;
+	}
+
+	if (sync->coarse != NULL) {
+		__atomic_store_n(&sync->coarse->time, globalTime(sync),
+			__ATOMIC_RELAXED);
+	}
+
+	if (sync->options.wakeupLead > 0 && !sync->wakeupSent)
+		return (sync->nextRequest - sync->options.wakeupLead) * sync->scale;
+
+	return sync->nextRequest * sync->scale;
+}
+
+
+void
+DRIFTsync_deliver(struct DRIFTsync *sync, const void *packet, int length,
+	double arrival)
+{
+	// Hands over a reply that the application received through its own
+	// connection, with the local time at which it arrived.
+	struct driftsync_wall_clock_packet buffer;
+	memset(&buffer, 0, sizeof(buffer));
+	if (length > (int)sizeof(buffer))
+		length = sizeof(buffer);
+	if (length > 0)
+		memcpy(&buffer, packet, length);
+
+	processReply(sync, &buffer, length, (int64_t)(arrival / sync->scale));
+}
+
+
+double
+DRIFTsync_localTime(struct DRIFTsync *sync)
+{
+	return localTime() * sync->scale;
+}
+
+
+double
+DRIFTsync_globalTime(struct DRIFTsync *sync)
+{
+	return globalTime(sync) * sync->scale;
+}
+
+
+int64_t
+DRIFTsync_globalTimeMicroseconds(struct DRIFTsync *sync)
+{
+	// Unscaled for callers that apply the scale themselves, like the C++
+	// global_clock does at compile time.
+	return globalTime(sync);
+}
+
+
+double
+DRIFTsync_globalTimeCoarse(struct DRIFTsync *sync)
+{
+	if (sync->coarse == NULL)
+		return globalTime(sync) * sync->scale;
+
+	return __atomic_load_n(&sync->coarse->time, __ATOMIC_RELAXED) * sync->scale;
+}
+
+
+double
+DRIFTsync_coarseLag(struct DRIFTsync *sync)
+{
+	if (sync->coarse == NULL)
+		return 0;
+
+	return __atomic_load_n(&sync->coarse->lag, __ATOMIC_RELAXED) * sync->scale;
+}
+
+
+int
+DRIFTsync_state(struct DRIFTsync *sync)
+{
+	int64_t lastAccepted = sync->lastAccepted;
+	if (lastAccepted == 0)
+		return STATE_UNSYNCHRONIZED;
+
+	return localTime() - lastAccepted > sync->holdoverTimeout
+		? STATE_HOLDOVER : STATE_LOCKED;
+}
+
+
+double
+DRIFTsync_errorBound(struct DRIFTsync *sync)
+{
+	struct estimate estimate;
+	readEstimate(sync, &estimate);
+	if (estimate.lastAccepted == 0)
+		return 0;
+
+	return (estimate.delayBound + estimateError(&estimate, localTime()))
+		* sync->scale;
+}
+
+
+void
+DRIFTsync_globalTimeInterval(struct DRIFTsync *sync, double *earliest,
+	double *latest)
+{
+	struct estimate estimate;
+	readEstimate(sync, &estimate);
+
+	int64_t local = localTime();
+	int64_t time = estimateTime(&estimate, local);
+	if (time == 0) {
+		*earliest = *latest = 0;
+		return;
+	}
+
+	// The global time runs ahead of the reference by the average request
+	// delay, so the delay bound only extends the interval to the past.
+	int64_t error = estimateError(&estimate, local);
+	*earliest = (time - estimate.delayBound - error) * sync->scale;
+	*latest = (time + error) * sync->scale;
+}
+
+
+double
+DRIFTsync_offset(struct DRIFTsync *sync)
+{
+	return sync->averageOffset * sync->scale;
+}
+
+
+double
+DRIFTsync_wallClockTime(struct DRIFTsync *sync)
+{
+	int64_t result = globalTime(sync);
+	if (result == 0 || sync->wallClock == 0)
+		return 0;
+
+	return (result + sync->wallClockOffset) * sync->scale;
+}
+
+
+double
+DRIFTsync_wallClockOffset(struct DRIFTsync *sync)
+{
+	return sync->wallClock != 0 ? sync->wallClockOffset * sync->scale : 0;
+}
+
+
+int
+DRIFTsync_wallClockIsTAI(struct DRIFTsync *sync)
+{
+	return (sync->wallClock & DRIFTSYNC_FLAG_WALL_CLOCK_TAI) != 0;
+}
+
+
+double
+DRIFTsync_clockRate(struct DRIFTsync *sync)
+{
+	return sync->clockRate;
+}
+
+
+double
+DRIFTsync_suggestPlaybackRate(struct DRIFTsync *sync, double globalStartTime,
+	double playbackPosition)
+{
+	double globalPosition = globalTime(sync) - globalStartTime / sync->scale;
+	double difference = globalPosition - playbackPosition / sync->scale;
+	if ((difference < 0 ? -difference : difference) < 5000)
+		return 1;
+
+	double rate = 1 + difference / 1000 / 1000;
+	return rate > 2 ? 2 : rate < 0.5 ? 0.5 : rate;
+}
+
+
+double
+DRIFTsync_medianRoundTripTime(struct DRIFTsync *sync)
+{
+	return medianRoundTripTime(sync, 0) * sync->scale;
+}
+
+
+void
+DRIFTsync_statistics(struct DRIFTsync *sync, struct statistics *stats)
+{
+	lockSync(sync);
+	memcpy(stats, &sync->statistics, sizeof(struct statistics));
+	unlockSync(sync);
+}
+
+
+int
+DRIFTsync_pathStatistics(struct DRIFTsync *sync, size_t index,
+	struct path_statistics *stats)
+{
+	lockSync(sync);
+	if (index >= sync->pathCount) {
+		unlockSync(sync);
+		return -1;
+	}
+
+	struct path *path = &sync->paths[index];
+	int64_t roundTripTime;
+	double offset;
+	double deviation;
+	pathQuality(path, &roundTripTime, &offset, &deviation);
+
+	memcpy(stats->name, path->name, sizeof(stats->name));
+	stats->active = index == sync->activePath;
+	stats->sentRequests = path->sentRequests;
+	stats->receivedSamples = path->receivedSamples;
+	stats->roundTripTime = roundTripTime * sync->scale;
+	stats->offset = offset * sync->scale;
+	stats->deviation = deviation * sync->scale;
+	unlockSync(sync);
+	return 0;
+}
+
+
+struct event_log *
+DRIFTsync_createEventLog(struct DRIFTsync *sync, size_t capacity)
+{
+	// Rounded up to a power of two so the ring positions can be masked.
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+
+	size_t length = sizeof(struct event_log) + size * sizeof(struct event);
+	struct event_log *log = (struct event_log *)aligned_alloc(64,
+		(length + 63) / 64 * 64);
+	if (log == NULL) {
+		printf("out of memory allocating event log\n");
+		return NULL;
+	}
+
+	log->sync = sync;
+	log->mask = size - 1;
+	log->head = 0;
+	log->dropped = 0;
+	log->tail = 0;
+	return log;
+}
+
+
+void
+DRIFTsync_destroyEventLog(struct event_log *log)
+{
+	free(log);
+}
+
+
+int
+DRIFTsync_logEvent(struct event_log *log, uint64_t data)
+{
+	// Only touches the log itself, the global time is determined at flush.
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	size_t head = log->head;
+	if (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) > log->mask) {
+		__atomic_store_n(&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	struct event *event = &log->events[head & log->mask];
+	event->time = (int64_t)time.tv_sec * 1000 * 1000 * 1000 + time.tv_nsec;
+	event->data = data;
+	__atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+size_t
+DRIFTsync_flushEventLog(struct event_log *log, struct global_event *events,
+	size_t count)
+{
+	struct DRIFTsync *sync = log->sync;
+
+	// Oldest first, so that the estimate in effect can be found by walking
+	// forward along with the events.
+	struct published_estimate history[ESTIMATE_HISTORY];
+	lockSync(sync);
+	size_t historyCount = sync->historyCount;
+	for (size_t i = 0; i < historyCount; i++) {
+		history[i] = sync->history[(sync->historyPosition + ESTIMATE_HISTORY
+			+ 1 - historyCount + i) % ESTIMATE_HISTORY];
+	}
+	unlockSync(sync);
+
+	size_t tail = log->tail;
+	size_t available = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE) - tail;
+	if (count > available)
+		count = available;
+
+	size_t current = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct event *event = &log->events[(tail + i) & log->mask];
+		int64_t local = event->time / 1000;
+		while (current + 1 < historyCount
+			&& history[current + 1].validFrom <= local) {
+			current++;
+		}
+
+		// Events from before the oldest estimate still in the history use
+		// that one.
+		int64_t global = historyCount > 0
+			? estimateTime(&history[current].estimate, local) : 0;
+		events[i].time = global == 0 ? 0
+			: (global + (event->time - local * 1000) / 1000.0) * sync->scale;
+		events[i].data = event->data;
+	}
+
+	__atomic_store_n(&log->tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+
+unsigned
+DRIFTsync_droppedEvents(struct event_log *log)
+{
+	return __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+}
+
+
+static inline int
+earlierCue(const struct queued_cue *one, const struct queued_cue *two)
+{
+	// Cues due at the same time are dispatched in the order of publishing.
+	return one->time < two->time
+		|| (one->time == two->time && one->sequence < two->sequence);
+}
+
+
+static int
+pushCue(struct cue_queue *queue, const struct driftsync_cue *packet)
+{
+	if (queue->count == queue->capacity) {
+		size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+		struct queued_cue *heap = (struct queued_cue *)realloc(queue->heap,
+			capacity * sizeof(struct queued_cue));
+		if (heap == NULL)
+			return -1;
+
+		queue->heap = heap;
+		queue->capacity = capacity;
+	}
+
+	struct queued_cue cue;
+	cue.time = packet->time;
+	cue.sequence = packet->sequence;
+	cue.length = packet->length;
+	memcpy(cue.payload, packet->payload, packet->length);
+
+	size_t position = queue->count++;
+	while (position > 0) {
+		size_t parent = (position - 1) / 2;
+		if (!earlierCue(&cue, &queue->heap[parent]))
+			break;
+
+		queue->heap[position] = queue->heap[parent];
+		position = parent;
+	}
+
+	queue->heap[position] = cue;
+	return 0;
+}
+
+
+static void
+popCue(struct cue_queue *queue, struct cue *cue)
+{
+	struct queued_cue *first = &queue->heap[0];
+	cue->time = first->time * queue->sync->scale;
+	cue->sequence = first->sequence;
+	cue->length = first->length;
+	memcpy(cue->payload, first->payload, first->length);
+
+	// Sift the last cue down from the top.
+	struct queued_cue last = queue->heap[--queue->count];
+	size_t position = 0;
+	while (1) {
+		size_t child = position * 2 + 1;
+		if (child >= queue->count)
+			break;
+
+		if (child + 1 < queue->count
+			&& earlierCue(&queue->heap[child + 1], &queue->heap[child])) {
+			child++;
+		}
+
+		if (!earlierCue(&queue->heap[child], &last))
+			break;
+
+		queue->heap[position] = queue->heap[child];
+		position = child;
+	}
+
+	queue->heap[position] = last;
+}
+
+
+static void
+sendCuePacket(struct cue_queue *queue, uint32_t flags, uint64_t sequence,
+	int64_t time, uint64_t sent, const void *payload, size_t length)
+{
+	struct driftsync_cue packet;
+	packet.magic = DRIFTSYNC_MAGIC;
+	packet.flags = DRIFTSYNC_FLAG_CUE | flags;
+	packet.sequence = sequence;
+	packet.time = time;
+	packet.sent = sent;
+	packet.length = length;
+	if (length > 0)
+		memcpy(packet.payload, payload, length);
+
+	if (send(queue->socket, &packet, DRIFTSYNC_CUE_HEADER_LENGTH + length, 0)
+			< 0) {
+		printf("failed to send cue packet: %s\n", strerror(errno));
+		// non-fatal
+	}
+}
+
+
+static void *
+cue_loop(void *data)
+{
+	struct cue_queue *queue = (struct cue_queue *)data;
+
+	struct driftsync_cue packet;
+	int64_t nextSubscribe = 0;
+
+	while (!queue->quitting) {
+		int64_t now = localTime();
+		if (queue->subscribe && now >= nextSubscribe) {
+			sendCuePacket(queue, DRIFTSYNC_CUE_SUBSCRIBE, 0, 0, 0, NULL, 0);
+			nextSubscribe = now + CUE_SUBSCRIBE_INTERVAL;
+		}
+
+		// The socket has a receive timeout of the subscribe interval.
+		int result = recv(queue->socket, &packet, sizeof(packet), 0);
+		if (queue->quitting)
+			break;
+
+		if (result < (int)DRIFTSYNC_CUE_HEADER_LENGTH
+			|| packet.magic != DRIFTSYNC_MAGIC
+			|| (packet.flags & DRIFTSYNC_FLAG_CUE) == 0
+			|| packet.length > DRIFTSYNC_CUE_PAYLOAD
+			|| result < (int)DRIFTSYNC_CUE_HEADER_LENGTH + packet.length) {
+			continue;
+		}
+
+		uint32_t type = packet.flags & (DRIFTSYNC_CUE_SUBSCRIBE
+			| DRIFTSYNC_CUE_PUBLISH | DRIFTSYNC_CUE_ACKNOWLEDGE);
+
+		if (type == (DRIFTSYNC_CUE_SUBSCRIBE | DRIFTSYNC_CUE_ACKNOWLEDGE)) {
+			// Echoed for the service to measure the round trip time.
+			sendCuePacket(queue, type, 0, 0, packet.sent, NULL, 0);
+			continue;
+		}
+
+		if (type == (DRIFTSYNC_CUE_PUBLISH | DRIFTSYNC_CUE_ACKNOWLEDGE)) {
+			pthread_mutex_lock(&queue->lock);
+			if (packet.sequence == queue->publishId) {
+				queue->publishedTime = packet.time;
+				queue->publishAnswered = 1;
+				pthread_cond_broadcast(&queue->condition);
+			}
+			pthread_mutex_unlock(&queue->lock);
+			continue;
+		}
+
+		if (type != 0)
+			continue;
+
+		// Acknowledged again when already received, in case the previous
+		// acknowledgement was lost.
+		sendCuePacket(queue, DRIFTSYNC_CUE_ACKNOWLEDGE, packet.sequence, 0,
+			packet.sent, NULL, 0);
+
+		pthread_mutex_lock(&queue->lock);
+		int duplicate = 0;
+		for (size_t i = 0; i < CUE_HISTORY && !duplicate; i++)
+			duplicate = queue->received[i] == packet.sequence;
+
+		int queued = 0;
+		if (!duplicate) {
+			queue->received[queue->receivedPosition] = packet.sequence;
+			queue->receivedPosition
+				= (queue->receivedPosition + 1) % CUE_HISTORY;
+
+			if ((int64_t)packet.time <= globalTime(queue->sync))
+				queue->late++;
+
+			queued = pushCue(queue, &packet);
+			pthread_cond_broadcast(&queue->condition);
+		}
+		pthread_mutex_unlock(&queue->lock);
+
+		if (queued != 0) {
+			printf("out of memory queueing cue\n");
+			// non-fatal
+		}
+	}
+
+	return NULL;
+}
+
+
+struct cue_queue *
+DRIFTsync_createCueQueue(struct DRIFTsync *sync, const char *server,
+	uint16_t port, int subscribe)
+{
+	struct cue_queue *queue
+		= (struct cue_queue *)calloc(1, sizeof(struct cue_queue));
+	if (queue == NULL) {
+		printf("out of memory allocating cue queue\n");
+		return NULL;
+	}
+
+	queue->sync = sync;
+	queue->subscribe = subscribe;
+	queue->publishId = randomPeerId();
+
+	queue->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (queue->socket < 0) {
+		printf("failed to create socket: %s\n", strerror(errno));
+		free(queue);
+		return NULL;
+	}
+
+	char service[10];
+	snprintf(service, sizeof(service), "%u", port);
+
+	// Connected, so that only packets of the service are received.
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo *addressInfo;
+	int result = getaddrinfo(server, service, &hints, &addressInfo);
+	if (result != 0 || addressInfo == NULL) {
+		printf("failed to resolve host \"%s\": %s\n", server,
+			gai_strerror(result));
+		close(queue->socket);
+		free(queue);
+		return NULL;
+	}
+
+	struct timeval timeout = {
+		.tv_sec = CUE_SUBSCRIBE_INTERVAL / 1000000,
+		.tv_usec = CUE_SUBSCRIBE_INTERVAL % 1000000
+	};
+
+	result = connect(queue->socket, addressInfo->ai_addr,
+		addressInfo->ai_addrlen);
+	freeaddrinfo(addressInfo);
+	if (result != 0 || setsockopt(queue->socket, SOL_SOCKET, SO_RCVTIMEO,
+			&timeout, sizeof(timeout)) != 0) {
+		printf("failed to set up cue socket: %s\n", strerror(errno));
+		close(queue->socket);
+		free(queue);
+		return NULL;
+	}
+
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->condition, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_mutex_init(&queue->publishLock, NULL);
+	pthread_create(&queue->thread, NULL, &cue_loop, queue);
+	return queue;
+}
+
+
+void
+DRIFTsync_destroyCueQueue(struct cue_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->quitting = 1;
+	pthread_cond_broadcast(&queue->condition);
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_cancel(queue->thread);
+	pthread_join(queue->thread, NULL);
+	close(queue->socket);
+
+	pthread_cond_destroy(&queue->condition);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_mutex_destroy(&queue->publishLock);
+	free(queue->heap);
+	free(queue);
+}
+
+
+static void
+waitCueCondition(struct cue_queue *queue, int64_t until)
+{
+	struct timespec spec = {
+		.tv_sec = until / 1000000,
+		.tv_nsec = (until % 1000000) * 1000
+	};
+
+	pthread_cond_timedwait(&queue->condition, &queue->lock, &spec);
+}
+
+
+double
+DRIFTsync_publishCue(struct cue_queue *queue, double time, const void *payload,
+	size_t length)
+{
+	// Returns the global time the service scheduled the cue for, 0 when it was
+	// rejected or the service did not answer.
+	if (length > DRIFTSYNC_CUE_PAYLOAD)
+		return 0;
+
+	int64_t remoteTime = (int64_t)(time / queue->sync->scale);
+
+	pthread_mutex_lock(&queue->publishLock);
+	pthread_mutex_lock(&queue->lock);
+	uint64_t id = ++queue->publishId;
+	queue->publishAnswered = 0;
+
+	for (int i = 0; i < CUE_PUBLISH_ATTEMPTS && !queue->publishAnswered
+			&& !queue->quitting; i++) {
+		pthread_mutex_unlock(&queue->lock);
+		sendCuePacket(queue, DRIFTSYNC_CUE_PUBLISH, id, remoteTime, 0, payload,
+			length);
+		pthread_mutex_lock(&queue->lock);
+
+		int64_t until = localTime() + CUE_PUBLISH_TIMEOUT;
+		while (!queue->publishAnswered && !queue->quitting
+			&& localTime() < until) {
+			waitCueCondition(queue, until);
+		}
+	}
+
+	int64_t scheduled = queue->publishAnswered ? queue->publishedTime : 0;
+	pthread_mutex_unlock(&queue->lock);
+	pthread_mutex_unlock(&queue->publishLock);
+	return scheduled * queue->sync->scale;
+}
+
+
+int
+DRIFTsync_waitCue(struct cue_queue *queue, struct cue *cue, int timeout)
+{
+	// Sleeps until shortly before the first cue is due and spins on the global
+	// time for the rest. Sleeps are limited so that the due time is projected
+	// to local time again with the current estimate.
+	int64_t end = timeout >= 0 ? localTime() + timeout : INT64_MAX;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->quitting) {
+		int64_t now = localTime();
+		int64_t wake = now + CUE_REPROJECT;
+
+		if (queue->count > 0) {
+			struct estimate estimate;
+			readEstimate(queue->sync, &estimate);
+
+			int64_t global = estimateTime(&estimate, now);
+			int64_t due = queue->heap[0].time;
+			int64_t remaining = global == 0 ? CUE_REPROJECT
+				: (int64_t)((due - global) / estimate.clockRate);
+
+			if (remaining <= CUE_SPIN) {
+				pthread_mutex_unlock(&queue->lock);
+				while (globalTime(queue->sync) < due)
+					;
+				pthread_mutex_lock(&queue->lock);
+
+				// Another waiter may have taken it meanwhile, while cues that
+				// arrived late may have been queued before it.
+				if (queue->count > 0 && queue->heap[0].time <= due) {
+					popCue(queue, cue);
+					pthread_mutex_unlock(&queue->lock);
+					return 0;
+				}
+
+				continue;
+			}
+
+			if (now + remaining - CUE_SPIN < wake)
+				wake = now + remaining - CUE_SPIN;
+		}
+
+		if (now >= end)
+			break;
+
+		waitCueCondition(queue, wake < end ? wake : end);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+	return -1;
+}
+
+
+unsigned
+DRIFTsync_lateCues(struct cue_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	unsigned late = queue->late;
+	pthread_mutex_unlock(&queue->lock);
+	return late;
+}
+
+
+struct jitter_buffer *
+DRIFTsync_createJitterBuffer(struct DRIFTsync *sync, double percentile,
+	double margin, double window)
+{
+	if (percentile <= 0 || percentile > 1 || margin < 0
+		|| window / sync->scale < 1) {
+		printf("invalid jitter buffer parameters\n");
+		return NULL;
+	}
+
+	struct jitter_buffer *buffer
+		= (struct jitter_buffer *)calloc(1, sizeof(struct jitter_buffer));
+	if (buffer == NULL) {
+		printf("out of memory allocating jitter buffer\n");
+		return NULL;
+	}
+
+	buffer->sync = sync;
+	buffer->percentile = percentile;
+	buffer->margin = (int64_t)(margin / sync->scale);
+	buffer->window = (int64_t)(window / sync->scale);
+	buffer->histograms[0].window = buffer->histograms[1].window = UINT64_MAX;
+	buffer->playoutDelay = -1;
+	return buffer;
+}
+
+
+void
+DRIFTsync_destroyJitterBuffer(struct jitter_buffer *buffer)
+{
+	free(buffer);
+}
+
+
+static inline size_t
+delayBucket(int64_t delay)
+{
+	// Exact below 2^DELAY_SUB_BITS, logarithmic with linear sub buckets above.
+	if (delay < (1 << DELAY_SUB_BITS))
+		return delay < 0 ? 0 : (size_t)delay;
+
+	int octave = 63 - __builtin_clzll((uint64_t)delay);
+	size_t bucket = ((size_t)(octave - DELAY_SUB_BITS + 1) << DELAY_SUB_BITS)
+		+ ((delay >> (octave - DELAY_SUB_BITS)) & ((1 << DELAY_SUB_BITS) - 1));
+	return bucket < DELAY_BUCKETS ? bucket : DELAY_BUCKETS - 1;
+}
+
+
+static inline int64_t
+delayBucketEnd(size_t bucket)
+{
+	// Largest delay in the bucket, so that percentiles are not underestimated.
+	if (bucket < (1 << DELAY_SUB_BITS))
+		return bucket;
+
+	int shift = (int)(bucket >> DELAY_SUB_BITS) - 1;
+	int64_t sub = bucket & ((1 << DELAY_SUB_BITS) - 1);
+	return (((1 << DELAY_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+
+static struct delay_histogram *
+currentHistogram(struct jitter_buffer *buffer, uint64_t window)
+{
+	struct delay_histogram *histogram = &buffer->histograms[window & 1];
+	uint64_t tagged = __atomic_load_n(&histogram->window, __ATOMIC_ACQUIRE);
+	if (tagged != window && __atomic_compare_exchange_n(&histogram->window,
+			&tagged, window, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		// Packets counted concurrently with the reset may get lost, which
+		// only affects the statistics marginally.
+		for (size_t i = 0; i < DELAY_BUCKETS; i++)
+			__atomic_store_n(&histogram->counts[i], 0, __ATOMIC_RELAXED);
+	}
+
+	return histogram;
+}
+
+
+static int64_t
+updatePlayoutDelay(struct jitter_buffer *buffer, uint64_t window)
+{
+	// Percentile over the current and the previous window. The counts are
+	// read once and the total taken from them, so that a histogram being
+	// reset by another thread meanwhile can only shift the percentile
+	// between the buckets actually seen.
+	uint32_t counts[DELAY_BUCKETS];
+	memset(counts, 0, sizeof(counts));
+
+	uint64_t total = 0;
+	size_t highest = 0;
+	for (size_t i = 0; i < 2; i++) {
+		struct delay_histogram *histogram = &buffer->histograms[i];
+		uint64_t tagged = __atomic_load_n(&histogram->window,
+			__ATOMIC_ACQUIRE);
+		if (tagged != window && tagged + 1 != window)
+			continue;
+
+		for (size_t bucket = 0; bucket < DELAY_BUCKETS; bucket++) {
+			uint32_t count = __atomic_load_n(&histogram->counts[bucket],
+				__ATOMIC_RELAXED);
+			if (count == 0)
+				continue;
+
+			counts[bucket] += count;
+			total += count;
+			if (bucket > highest)
+				highest = bucket;
+		}
+	}
+
+	int64_t current = __atomic_load_n(&buffer->playoutDelay, __ATOMIC_RELAXED);
+	if (total == 0)
+		return current >= 0 ? current : buffer->margin;
+
+	uint64_t target = (uint64_t)ceil(total * buffer->percentile);
+	uint64_t seen = 0;
+	size_t bucket = 0;
+	for (; bucket < highest; bucket++) {
+		seen += counts[bucket];
+		if (seen >= target)
+			break;
+	}
+
+	// Raised right away when delays grow, but only lowered gradually when
+	// they shrink, to not skip ahead in the media abruptly.
+	int64_t delay = delayBucketEnd(bucket) + buffer->margin;
+	if (current >= 0 && delay < current)
+		delay = current - (current - delay) / 8;
+
+	__atomic_store_n(&buffer->playoutDelay, delay, __ATOMIC_RELAXED);
+	return delay;
+}
 
-	free(sync);
+
+double
+DRIFTsync_playoutTime(struct jitter_buffer *buffer, double senderTime,
+	double arrival)
+{
+	// Returns the local time to play the packet at, 0 while not synchronized.
+	struct DRIFTsync *sync = buffer->sync;
+	struct estimate estimate;
+	readEstimate(sync, &estimate);
+
+	int64_t local = arrival != 0 ? (int64_t)(arrival / sync->scale)
+		: localTime();
+	int64_t global = estimateTime(&estimate, local);
+	if (global == 0)
+		return 0;
+
+	int64_t sent = (int64_t)(senderTime / sync->scale);
+	uint64_t window = local / buffer->window;
+	struct delay_histogram *histogram = currentHistogram(buffer, window);
+	__atomic_fetch_add(&histogram->counts[delayBucket(global - sent)], 1,
+		__ATOMIC_RELAXED);
+
+	uint64_t packets = __atomic_add_fetch(&buffer->packets, 1,
+		__ATOMIC_RELAXED);
+	int64_t delay = __atomic_load_n(&buffer->playoutDelay, __ATOMIC_RELAXED);
+	if (delay < 0 || packets % PLAYOUT_UPDATE_PACKETS == 0)
+		delay = updatePlayoutDelay(buffer, window);
+
+	int64_t playAt = estimateLocal(&estimate, sent + delay);
+	if (playAt < local)
+		__atomic_fetch_add(&buffer->late, 1, __ATOMIC_RELAXED);
+
+	return playAt * sync->scale;
 }
 
 
-struct DRIFTsync *
-DRIFTsync_create(const char *server, uint16_t port, double scale, int interval,
-	int measureAccuracy)
+double
+DRIFTsync_playoutDelay(struct jitter_buffer *buffer)
 {
-	struct DRIFTsync *sync
-		= (struct DRIFTsync *)malloc(sizeof(struct DRIFTsync));
-	if (sync == NULL) {
-		printf("out of memory allocating sync struct\n");
-		return NULL;
-	}
+	int64_t delay = __atomic_load_n(&buffer->playoutDelay, __ATOMIC_RELAXED);
+	return delay < 0 ? 0 : delay * buffer->sync->scale;
+}
 
-	sync->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sync->socket < 0) {
-		printf("failed to create socket: %s\n", strerror(errno));
-		free(sync);
+
+uint64_t
+DRIFTsync_latePackets(struct jitter_buffer *buffer)
+{
+	return __atomic_load_n(&buffer->late, __ATOMIC_RELAXED);
+}
+
+
+struct sample_archive *
+DRIFTsync_createArchive(struct DRIFTsync *sync, size_t size)
+{
+	struct sample_archive *archive
+		= (struct sample_archive *)malloc(sizeof(struct sample_archive));
+	if (archive == NULL) {
+		printf("out of memory allocating sample archive\n");
 		return NULL;
 	}
 
-	char service[10];
-	snprintf(service, sizeof(service), "%u", port);
+	archive->capacity = size / sizeof(struct archive_block);
+	if (archive->capacity < 2)
+		archive->capacity = 2;
 
-	struct addrinfo *addressInfo;
-	int result = getaddrinfo(server, service, NULL, &addressInfo);
-	if (result != 0 || addressInfo == NULL) {
-		printf("failed to resolve host \"%s\": %s\n", server,
-			gai_strerror(result));
-		free(sync);
+	archive->blocks = (struct archive_block *)malloc(
+		archive->capacity * sizeof(struct archive_block));
+	if (archive->blocks == NULL) {
+		printf("out of memory allocating sample archive blocks\n");
+		free(archive);
 		return NULL;
 	}
 
-	memcpy(&sync->server, addressInfo->ai_addr, addressInfo->ai_addrlen);
-	freeaddrinfo(addressInfo);
+	archive->sync = sync;
+	pthread_mutex_init(&archive->lock, NULL);
+	archive->first = 0;
+	archive->count = 0;
+	archive->dropped = 0;
+	archive->droppedBlocks = 0;
+	resetArchiveState(&archive->state);
+
+	// Replaces a previous archive, which keeps what it recorded so far.
+	lockSync(sync);
+	sync->archive = archive;
+	unlockSync(sync);
+	return archive;
+}
 
-	pthread_mutex_init(&sync->lock, NULL);
-	pthread_cond_init(&sync->condition, NULL);
 
-	sync->maxSamples = 10;
-	sync->clockRate = 1.0;
-	sync->averageOffset = 0;
-	memset(&sync->statistics, 0, sizeof(struct statistics));
+void
+DRIFTsync_destroyArchive(struct sample_archive *archive)
+{
+	// Appending happens under the lock of the sync.
+	lockSync(archive->sync);
+	if (archive->sync->archive == archive)
+		archive->sync->archive = NULL;
+	unlockSync(archive->sync);
+
+	pthread_mutex_destroy(&archive->lock);
+	free(archive->blocks);
+	free(archive);
+}
 
-	ring_buffer_init(&sync->roundTripTimes, sync->maxSamples, sizeof(int64_t));
-	ring_buffer_init(&sync->sortedRoundTripTimes, sync->maxSamples,
-		sizeof(int64_t));
-	ring_buffer_init(&sync->samples, sync->maxSamples, sizeof(struct sample));
-	ring_buffer_init(&sync->offsets, sync->maxSamples, sizeof(int64_t));
-	ring_buffer_init(&sync->accuracySamples, sync->maxSamples, sizeof(int64_t));
 
-	sync->interval.tv_sec = interval / 1000000;
-	sync->interval.tv_nsec = (interval % 1000000) * 1000;
+struct bit_reader {
+	const uint8_t *data;
+	uint32_t position;
+};
 
-	sync->scale = scale;
-	sync->measureAccuracy = measureAccuracy;
-	sync->quitting = 0;
 
-	pthread_create(&sync->receiveThread, NULL, &receive_loop, sync);
-	pthread_create(&sync->requestThread, NULL, &request_loop, sync);
+static uint64_t
+readBits(struct bit_reader *reader, int count)
+{
+	uint64_t value = 0;
+	while (count > 0) {
+		int used = reader->position % 8;
+		int take = 8 - used < count ? 8 - used : count;
+		unsigned byte = reader->data[reader->position / 8];
+		value = (value << take)
+			| ((byte >> (8 - used - take)) & ((1u << take) - 1));
+		reader->position += take;
+		count -= take;
+	}
 
-	return sync;
+	return value;
 }
 
 
-double
-DRIFTsync_localTime(struct DRIFTsync *sync)
+static inline int64_t
+readSigned(struct bit_reader *reader, int count)
 {
-	return localTime() * sync->scale;
+	uint64_t value = readBits(reader, count);
+	if (count < 64 && (value >> (count - 1)) != 0)
+		value |= ~UINT64_C(0) << count;
+	return (int64_t)value;
 }
 
 
-double
-DRIFTsync_globalTime(struct DRIFTsync *sync)
+static int64_t
+readDeltaOfDelta(struct bit_reader *reader)
 {
-	return globalTime(sync) * sync->scale;
+	if (readBits(reader, 1) == 0)
+		return 0;
+	if (readBits(reader, 1) == 0)
+		return readSigned(reader, 8);
+	if (readBits(reader, 1) == 0)
+		return readSigned(reader, 12);
+	if (readBits(reader, 1) == 0)
+		return readSigned(reader, 20);
+	return readSigned(reader, 64);
 }
 
 
-double
-DRIFTsync_offset(struct DRIFTsync *sync)
+static uint64_t
+readXor(struct bit_reader *reader, struct xor_series *series)
 {
-	return sync->averageOffset * sync->scale;
+	if (readBits(reader, 1) == 0)
+		return series->value;
+
+	if (readBits(reader, 1) != 0) {
+		series->leading = (int)readBits(reader, 6);
+		int length = (int)readBits(reader, 6) + 1;
+		series->trailing = 64 - series->leading - length;
+	}
+
+	series->value ^= readBits(reader,
+		64 - series->leading - series->trailing) << series->trailing;
+	return series->value;
 }
 
 
-double
-DRIFTsync_clockRate(struct DRIFTsync *sync)
+static void
+readRecord(struct bit_reader *reader, struct archive_state *state, int first,
+	int64_t *offset, int64_t *roundTripTime)
 {
-	return sync->clockRate;
+	if (first)
+		state->local = (int64_t)readBits(reader, 64);
+	else {
+		state->delta += readDeltaOfDelta(reader);
+		state->local += state->delta;
+	}
+
+	*offset = (int64_t)readXor(reader, &state->offset);
+	*roundTripTime = (int64_t)readXor(reader, &state->roundTripTime);
+
+	if (readBits(reader, 1) != 0)
+		state->decision = (int)readBits(reader, 2);
 }
 
 
-double
-DRIFTsync_suggestPlaybackRate(struct DRIFTsync *sync, double globalStartTime,
-	double playbackPosition)
+size_t
+DRIFTsync_readArchive(struct sample_archive *archive, double from, double to,
+	struct archived_sample *samples, size_t count)
 {
-	double globalPosition = globalTime(sync) - globalStartTime / sync->scale;
-	double difference = globalPosition - playbackPosition / sync->scale;
-	if ((difference < 0 ? -difference : difference) < 5000)
-		return 1;
+	// Unbounded ranges can be given as -DBL_MAX and DBL_MAX.
+	double scale = archive->sync->scale;
+	int64_t start = from / scale <= INT64_MIN ? INT64_MIN
+		: (int64_t)ceil(from / scale);
+	int64_t end = to / scale >= (double)INT64_MAX ? INT64_MAX
+		: (int64_t)ceil(to / scale);
+
+	pthread_mutex_lock(&archive->lock);
+
+	// Blocks are in order of their local times, skip all that end before
+	// the range.
+	size_t low = 0;
+	size_t high = archive->count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		struct archive_block *block = &archive->blocks[(archive->first
+			+ middle) % archive->capacity];
+		if (block->highest < start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
 
-	double rate = 1 + difference / 1000 / 1000;
-	return rate > 2 ? 2 : rate < 0.5 ? 0.5 : rate;
+	uint64_t next = archive->droppedBlocks + low;
+	pthread_mutex_unlock(&archive->lock);
+
+	// Each block is copied out under the lock and decoded outside of it, to
+	// not hold up the receive thread archiving samples. Blocks dropped in
+	// between are skipped.
+	struct archive_block block;
+	size_t result = 0;
+	while (result < count) {
+		pthread_mutex_lock(&archive->lock);
+		if (next < archive->droppedBlocks)
+			next = archive->droppedBlocks;
+
+		size_t index = (size_t)(next - archive->droppedBlocks);
+		if (index >= archive->count) {
+			pthread_mutex_unlock(&archive->lock);
+			break;
+		}
+
+		block = archive->blocks[(archive->first + index) % archive->capacity];
+		pthread_mutex_unlock(&archive->lock);
+
+		if (block.lowest >= end)
+			break;
+
+		next++;
+		struct bit_reader reader = {
+			.data = block.data,
+			.position = 0
+		};
+
+		struct archive_state state;
+		resetArchiveState(&state);
+		for (uint32_t j = 0; j < block.count && result < count; j++) {
+			int64_t offset;
+			int64_t roundTripTime;
+			readRecord(&reader, &state, j == 0, &offset, &roundTripTime);
+			if (state.local < start || state.local >= end)
+				continue;
+
+			struct archived_sample *sample = &samples[result++];
+			sample->local = state.local * scale;
+			sample->remote = (state.local + offset) * scale;
+			sample->roundTripTime = roundTripTime * scale;
+			sample->decision = state.decision;
+		}
+	}
+
+	return result;
 }
 
 
-double
-DRIFTsync_medianRoundTripTime(struct DRIFTsync *sync)
+uint64_t
+DRIFTsync_archivedSamples(struct sample_archive *archive, size_t *bytes)
 {
-	return medianRoundTripTime(sync, 0) * sync->scale;
+	// Bytes actually used by the encoded records, excluding the unused rest
+	// of the blocks.
+	uint64_t samples = 0;
+	size_t bits = 0;
+
+	pthread_mutex_lock(&archive->lock);
+	for (size_t i = 0; i < archive->count; i++) {
+		struct archive_block *block
+			= &archive->blocks[(archive->first + i) % archive->capacity];
+		samples += block->count;
+		bits += block->bits;
+	}
+	pthread_mutex_unlock(&archive->lock);
+
+	if (bytes != NULL)
+		*bytes = (bits + 7) / 8;
+	return samples;
 }
 
 
-void
-DRIFTsync_statistics(struct DRIFTsync *sync, struct statistics *stats)
+uint64_t
+DRIFTsync_droppedSamples(struct sample_archive *archive)
 {
-	pthread_mutex_lock(&sync->lock);
-	memcpy(stats, &sync->statistics, sizeof(struct statistics));
-	pthread_mutex_unlock(&sync->lock);
+	pthread_mutex_lock(&archive->lock);
+	uint64_t dropped = archive->dropped;
+	pthread_mutex_unlock(&archive->lock);
+	return dropped;
 }
 
 
@@ -515,12 +3600,12 @@ DRIFTsync_accuracy(struct DRIFTsync *sync, struct accuracy *accuracy, int wait,
 	if (!sync->measureAccuracy)
 		return;
 
-	pthread_mutex_lock(&sync->lock);
+	lockSync(sync);
 
 	if (reset)
 		ring_buffer_clear(&sync->accuracySamples);
 
-	if (wait) {
+	if (wait && !sync->options.polled) {
 		if (_timeout > 0) {
 			struct timespec spec;
 			clock_gettime(CLOCK_REALTIME, &spec);
@@ -543,7 +3628,7 @@ DRIFTsync_accuracy(struct DRIFTsync *sync, struct accuracy *accuracy, int wait,
 	}
 
 	if (sync->accuracySamples.count == 0) {
-		pthread_mutex_unlock(&sync->lock);
+		unlockSync(sync);
 		return;
 	}
 
@@ -557,7 +3642,421 @@ DRIFTsync_accuracy(struct DRIFTsync *sync, struct accuracy *accuracy, int wait,
 	accuracy->average *= sync->scale;
 	accuracy->max *= sync->scale;
 
-	pthread_mutex_unlock(&sync->lock);
+	unlockSync(sync);
+}
+
+
+#ifndef DRIFTSYNC_NO_MAIN
+// Demo, built unless the client is linked into an application.
+
+static int
+benchmark(struct DRIFTsync *sync, int seconds)
+{
+	// Synthetic workload, the sync was created without request interval so the
+	// request thread saturates the server and the receive path of the client
+	// while the global time is queried continuously.
+	volatile double sink = 0;
+	int64_t calls = 0;
+	int64_t start = localTime();
+	int64_t end = start + (int64_t)seconds * 1000 * 1000;
+	while (localTime() < end) {
+		for (int i = 0; i < 1000; i++)
+			sink += DRIFTsync_globalTime(sync);
+		calls += 1000;
+	}
+
+	int64_t elapsed = localTime() - start;
+	(void)sink;
+
+	struct statistics stats;
+	DRIFTsync_statistics(sync, &stats);
+
+	printf("replies %.0f/s round trip time %.3f ms global time %.1f ns\n",
+		stats.receivedSamples * 1000.0 * 1000 / elapsed,
+		DRIFTsync_medianRoundTripTime(sync), elapsed * 1000.0 / calls);
+
+	DRIFTsync_quit(sync);
+
+	// Lets the build comparison stop instead of comparing against nothing.
+	return stats.receivedSamples > 0 ? 0 : 1;
+}
+
+
+static int
+validate(struct DRIFTsync *sync, int seconds)
+{
+	// Only meaningful with the server on the same host, where the reference
+	// time is the local monotonic clock and the true global time is known.
+	struct timespec sleepTime = {
+		.tv_sec = 0,
+		.tv_nsec = 1000 * 1000
+	};
+
+	int64_t total = 0;
+	int64_t contained = 0;
+	double width = 0;
+	double end = DRIFTsync_localTime(sync) + seconds * 1000.0;
+	while (DRIFTsync_localTime(sync) < end) {
+		double earliest, latest;
+		double before = DRIFTsync_localTime(sync);
+		DRIFTsync_globalTimeInterval(sync, &earliest, &latest);
+		double after = DRIFTsync_localTime(sync);
+
+		if (earliest != 0) {
+			total++;
+			contained += earliest <= after && latest >= before;
+			width += latest - earliest;
+		}
+
+		nanosleep(&sleepTime, NULL);
+	}
+
+	printf("%" PRId64 " of %" PRId64 " intervals (%.3f%%) contained the true"
+		" time, average width %.3f ms\n", contained, total,
+		total > 0 ? contained * 100.0 / total : 0, total > 0 ? width / total : 0);
+
+	DRIFTsync_quit(sync);
+	return 0;
+}
+
+
+static int
+eventsBenchmark(struct DRIFTsync *sync, int seconds)
+{
+	// Records events in batches and flushes them in between, checking the
+	// flushed times against the global time right after each batch.
+	struct timespec sleepTime = {
+		.tv_sec = 0,
+		.tv_nsec = 10 * 1000 * 1000
+	};
+
+	while (DRIFTsync_globalTime(sync) == 0)
+		nanosleep(&sleepTime, NULL);
+
+	size_t batch = 4096;
+	struct event_log *log = DRIFTsync_createEventLog(sync, batch);
+	struct global_event *events
+		= (struct global_event *)malloc(batch * sizeof(struct global_event));
+	if (log == NULL || events == NULL) {
+		printf("out of memory allocating events\n");
+		return 1;
+	}
+
+	int64_t logTime = 0;
+	int64_t flushTime = 0;
+	int64_t total = 0;
+	double maxError = 0;
+	int64_t end = localTime() + (int64_t)seconds * 1000 * 1000;
+	while (localTime() < end) {
+		int64_t start = localTime();
+		for (size_t i = 0; i < batch; i++)
+			DRIFTsync_logEvent(log, i);
+		int64_t logged = localTime();
+		double globalTime = DRIFTsync_globalTime(sync);
+
+		size_t count = DRIFTsync_flushEventLog(log, events, batch);
+		flushTime += localTime() - logged;
+		logTime += logged - start;
+		total += count;
+
+		if (count == 0)
+			continue;
+
+		double error = globalTime - events[count - 1].time;
+		if (error > maxError)
+			maxError = error;
+	}
+
+	if (total == 0) {
+		printf("no events flushed\n");
+		free(events);
+		DRIFTsync_destroyEventLog(log);
+		DRIFTsync_quit(sync);
+		return 1;
+	}
+
+	printf("events %" PRId64 " log %.1f ns flush %.1f ns per event, max"
+		" error %.3f ms\n", total, logTime * 1000.0 / total,
+		flushTime * 1000.0 / total, maxError);
+
+	free(events);
+	DRIFTsync_destroyEventLog(log);
+	DRIFTsync_quit(sync);
+	return 0;
+}
+
+
+static int
+jitterBenchmark(struct DRIFTsync *sync, int seconds)
+{
+	// Feeds packets with synthetic one way delays of 2 ms plus an exponential
+	// part with a mean of 1 ms and reports how many would have played late
+	// against the 99th percentile with a margin of 0.5 ms.
+	struct timespec sleepTime = {
+		.tv_sec = 0,
+		.tv_nsec = 10 * 1000 * 1000
+	};
+
+	while (DRIFTsync_globalTime(sync) == 0)
+		nanosleep(&sleepTime, NULL);
+
+	struct jitter_buffer *buffer = DRIFTsync_createJitterBuffer(sync, 0.99,
+		0.5, 1000);
+	if (buffer == NULL)
+		return 1;
+
+	uint64_t state = 1;
+	int64_t packets = 0;
+	int64_t elapsed = 0;
+	int64_t end = localTime() + (int64_t)seconds * 1000 * 1000;
+	while (localTime() < end) {
+		double delays[1000];
+		for (int i = 0; i < 1000; i++) {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			double random = ((state * 2685821657736338717ull) >> 11)
+				* (1.0 / (UINT64_C(1) << 53));
+			delays[i] = 2 - log(1 - random);
+		}
+
+		int64_t start = localTime();
+		for (int i = 0; i < 1000; i++) {
+			DRIFTsync_playoutTime(buffer, DRIFTsync_globalTime(sync)
+				- delays[i], 0);
+		}
+
+		elapsed += localTime() - start;
+		packets += 1000;
+	}
+
+	printf("packets %" PRId64 " late %.3f%% playout delay %.3f ms %.1f ns per"
+		" packet\n", packets, DRIFTsync_latePackets(buffer) * 100.0 / packets,
+		DRIFTsync_playoutDelay(buffer), elapsed * 1000.0 / packets);
+
+	DRIFTsync_destroyJitterBuffer(buffer);
+	DRIFTsync_quit(sync);
+	return 0;
+}
+
+
+static int
+archiveBenchmark(struct DRIFTsync *sync, int days)
+{
+	// Archives synthetic exchanges at the default interval of 5 seconds with
+	// scheduling jitter, a drifting offset with noise and round trip times
+	// with an exponential tail, then decodes them to verify the round trip.
+	struct sample_archive *archive = DRIFTsync_createArchive(sync,
+		64 * 1024 * 1024);
+	if (archive == NULL)
+		return 1;
+
+	// Only the synthetic exchanges go into the archive.
+	lockSync(sync);
+	sync->archive = NULL;
+	unlockSync(sync);
+
+	size_t count = (size_t)days * 24 * 60 * 60 / 5;
+	int64_t *values = (int64_t *)malloc(count * 4 * sizeof(int64_t));
+	struct archived_sample *samples = (struct archived_sample *)malloc(
+		count * sizeof(struct archived_sample));
+	if (values == NULL || samples == NULL) {
+		printf("out of memory allocating samples\n");
+		return 1;
+	}
+
+	uint64_t state = 1;
+	int64_t local = localTime();
+	for (size_t i = 0; i < count; i++) {
+		double random[3];
+		for (int j = 0; j < 3; j++) {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			random[j] = ((state * 2685821657736338717ull) >> 11)
+				* (1.0 / (UINT64_C(1) << 53));
+		}
+
+		local += 5000 * 1000 + (int64_t)(random[0] * 100);
+		values[i * 4] = local;
+		values[i * 4 + 1] = 1234567890123 + (int64_t)(local * 20e-6)
+			+ (int64_t)(random[1] * 40);
+		values[i * 4 + 2] = 150 - (int64_t)(30 * log(1 - random[2]));
+		values[i * 4 + 3] = random[0] < 0.01
+			? ARCHIVE_REJECTED : ARCHIVE_ACCEPTED;
+	}
+
+	int64_t start = localTime();
+	for (size_t i = 0; i < count; i++) {
+		archiveSample(archive, values[i * 4], values[i * 4 + 1],
+			values[i * 4 + 2], (int)values[i * 4 + 3]);
+	}
+	int64_t appended = localTime();
+
+	size_t decoded = DRIFTsync_readArchive(archive, 0, DBL_MAX, samples,
+		count);
+	int64_t finished = localTime();
+
+	size_t mismatches = decoded == count ? 0 : count;
+	for (size_t i = 0; i < decoded && mismatches == 0; i++) {
+		if (llround(samples[i].local / sync->scale) != values[i * 4]
+			|| llround((samples[i].remote - samples[i].local) / sync->scale)
+				!= values[i * 4 + 1]
+			|| llround(samples[i].roundTripTime / sync->scale)
+				!= values[i * 4 + 2]
+			|| samples[i].decision != values[i * 4 + 3]) {
+			mismatches++;
+		}
+	}
+
+	// One hour from the middle.
+	double from = values[count / 2 * 4] * sync->scale;
+	int64_t rangeStart = localTime();
+	size_t range = DRIFTsync_readArchive(archive, from,
+		from + 60 * 60 * 1000 * 1000.0 * sync->scale, samples, count);
+	int64_t rangeEnd = localTime();
+
+	size_t bytes;
+	uint64_t archived = DRIFTsync_archivedSamples(archive, &bytes);
+	printf("samples %" PRIu64 " %.2f bytes per sample append %.1f ns decode"
+		" %.1f ns per sample, %zu mismatches\n", archived,
+		(double)bytes / archived, (appended - start) * 1000.0 / count,
+		(finished - appended) * 1000.0 / count, mismatches);
+	printf("range of %zu samples decoded in %" PRId64 " us\n", range,
+		rangeEnd - rangeStart);
+
+	free(values);
+	free(samples);
+	DRIFTsync_destroyArchive(archive);
+	DRIFTsync_quit(sync);
+	return mismatches == 0 ? 0 : 1;
+}
+
+
+static int
+cues(struct DRIFTsync *sync, const char *service, const char *text)
+{
+	// Publishes the text as a cue scheduled by the service, or subscribes and
+	// prints how precisely each cue is dispatched.
+	struct timespec sleepTime = {
+		.tv_sec = 0,
+		.tv_nsec = 10 * 1000 * 1000
+	};
+
+	while (DRIFTsync_globalTime(sync) == 0)
+		nanosleep(&sleepTime, NULL);
+
+	struct cue_queue *queue = DRIFTsync_createCueQueue(sync, service,
+		DRIFTSYNC_CUE_PORT, text == NULL);
+	if (queue == NULL)
+		return 1;
+
+	if (text != NULL) {
+		double time = DRIFTsync_publishCue(queue, 0, text, strlen(text));
+		if (time != 0) {
+			printf("cue scheduled for %.3f ms in %.3f ms\n", time,
+				time - DRIFTsync_globalTime(sync));
+		} else
+			printf("cue rejected or not answered\n");
+
+		DRIFTsync_destroyCueQueue(queue);
+		DRIFTsync_quit(sync);
+		return time == 0;
+	}
+
+	struct cue cue;
+	while (1) {
+		if (DRIFTsync_waitCue(queue, &cue, -1) != 0)
+			continue;
+
+		double late = DRIFTsync_globalTime(sync) - cue.time;
+		printf("cue %" PRIu64 " \"%.*s\" at %.3f ms late %.3f ms, %u arrived"
+			" late\n", cue.sequence, (int)cue.length, cue.payload, cue.time,
+			late, DRIFTsync_lateCues(queue));
+		fflush(stdout);
+	}
+
+	return 0;
+}
+
+
+// Answers requests in place like a server on the same host would, to measure
+// the per sample overhead of the client without any network involved.
+
+struct loopback {
+	struct DRIFTsync *sync;
+	uint64_t epoch;
+};
+
+
+static int
+loopback_send(void *context, const void *packet, int length)
+{
+	struct loopback *loopback = (struct loopback *)context;
+
+	struct driftsync_wall_clock_packet reply;
+	if (length > (int)sizeof(reply))
+		return -1;
+
+	memcpy(&reply, packet, length);
+	if ((reply.packet.flags & DRIFTSYNC_FLAG_WAKEUP) != 0)
+		return length;
+
+	reply.packet.flags = DRIFTSYNC_FLAG_REPLY;
+	reply.packet.remote = localTime();
+	reply.packet.epoch = loopback->epoch;
+
+	DRIFTsync_deliver(loopback->sync, &reply, sizeof(reply.packet),
+		DRIFTsync_localTime(loopback->sync));
+	return length;
+}
+
+
+static int
+loopbackBenchmark(int seconds)
+{
+	struct loopback loopback = {
+		.sync = NULL,
+		.epoch = 1
+	};
+
+	struct transport transport = {
+		.context = &loopback,
+		.send = &loopback_send,
+		.receive = NULL
+	};
+
+	struct options options;
+	DRIFTsync_defaultOptions(&options);
+	options.polled = 1;
+	options.transport = &transport;
+
+	struct DRIFTsync *sync = DRIFTsync_createWithOptions(NULL, 0, SCALE_MS, 0,
+		0, &options);
+	if (sync == NULL)
+		return 1;
+
+	loopback.sync = sync;
+
+	// Every poll sends a request that is answered and processed right away.
+	int64_t start = localTime();
+	int64_t end = start + (int64_t)seconds * 1000 * 1000;
+	while (localTime() < end) {
+		for (int i = 0; i < 1000; i++)
+			DRIFTsync_poll(sync, DRIFTsync_localTime(sync));
+	}
+
+	int64_t elapsed = localTime() - start;
+
+	struct statistics stats;
+	DRIFTsync_statistics(sync, &stats);
+
+	printf("loopback samples %d overhead %.1f ns per sample\n",
+		stats.receivedSamples, stats.receivedSamples > 0
+			? elapsed * 1000.0 / stats.receivedSamples : 0);
+
+	DRIFTsync_quit(sync);
+	return 0;
 }
 
 
@@ -570,11 +4069,90 @@ main(int argc, char *argv[])
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
 
-	struct DRIFTsync *sync = DRIFTsync_create(argc > 1 ? argv[1] : "localhost",
-		DRIFTSYNC_PORT, SCALE_MS, 5000 * 1000, 1);
+	struct options options;
+	DRIFTsync_defaultOptions(&options);
+
+	int benchmarkSeconds = 0;
+	int validateSeconds = 0;
+	int loopbackSeconds = 0;
+	int eventsSeconds = 0;
+	int jitterSeconds = 0;
+	int archiveDays = 0;
+	const char *cueService = NULL;
+	const char *cueText = NULL;
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--benchmark") == 0)
+			benchmarkSeconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--loopback") == 0)
+			loopbackSeconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--events") == 0)
+			eventsSeconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--jitter") == 0)
+			jitterSeconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--archive") == 0)
+			archiveDays = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--validate") == 0)
+			validateSeconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--realtime") == 0)
+			options.realtimePriority = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--cpu") == 0)
+			options.cpu = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--busy-poll") == 0)
+			options.busyPoll = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--dscp") == 0)
+			options.dscp = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--socket-priority") == 0)
+			options.socketPriority = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--refclock") == 0)
+			options.refclockUnit = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--coarse") == 0)
+			options.coarseInterval = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--wakeup") == 0)
+			options.wakeupLead = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--peer") == 0)
+			options.peerPort = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--cues") == 0)
+			cueService = argv[i + 1];
+		else if (strcmp(argv[i], "--cue") == 0)
+			cueText = argv[i + 1];
+		else if (strcmp(argv[i], "--paths") == 0)
+			options.paths = argv[i + 1];
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--polled") == 0)
+			options.polled = 1;
+		else if (strcmp(argv[i], "--telemetry") == 0)
+			options.telemetry = 1;
+	}
+
+	if (loopbackSeconds > 0)
+		return loopbackBenchmark(loopbackSeconds);
+
+	struct DRIFTsync *sync = DRIFTsync_createWithOptions(
+		argc > 1 ? argv[1] : "localhost", DRIFTSYNC_PORT, SCALE_MS,
+		benchmarkSeconds > 0 ? 0 : 5000 * 1000, 1, &options);
 	if (sync == NULL)
 		return 1;
 
+	if (benchmarkSeconds > 0)
+		return benchmark(sync, benchmarkSeconds);
+
+	if (validateSeconds > 0)
+		return validate(sync, validateSeconds);
+
+	if (eventsSeconds > 0)
+		return eventsBenchmark(sync, eventsSeconds);
+
+	if (jitterSeconds > 0)
+		return jitterBenchmark(sync, jitterSeconds);
+
+	if (archiveDays > 0)
+		return archiveBenchmark(sync, archiveDays);
+
+	if (cueService != NULL)
+		return cues(sync, cueService, cueText);
+
 	int stream = 0;
 	for (int i = 1; i < argc && !stream; i++)
 		stream = strcmp(argv[i], "--stream") == 0;
@@ -600,7 +4178,27 @@ main(int argc, char *argv[])
 		}
 
 		struct accuracy accuracy;
-		DRIFTsync_accuracy(sync, &accuracy, 1, 0, 15000 * 1000);
+		if (options.polled) {
+			// Emulates the main loop of an application at 60 frames per second
+			// until the next request has been sent.
+			struct timespec frameTime = {
+				.tv_sec = 0,
+				.tv_nsec = 16666667
+			};
+
+			double due = DRIFTsync_poll(sync, DRIFTsync_localTime(sync));
+			while (DRIFTsync_poll(sync, DRIFTsync_localTime(sync)) == due)
+				nanosleep(&frameTime, NULL);
+
+			// Leave time for the reply to the request just sent.
+			for (int i = 0; i < 10; i++) {
+				nanosleep(&frameTime, NULL);
+				DRIFTsync_poll(sync, DRIFTsync_localTime(sync));
+			}
+
+			DRIFTsync_accuracy(sync, &accuracy, 0, 0, 0);
+		} else
+			DRIFTsync_accuracy(sync, &accuracy, 1, 0, 15000 * 1000);
 
 		struct statistics stats;
 		DRIFTsync_statistics(sync, &stats);
@@ -609,13 +4207,36 @@ main(int argc, char *argv[])
 
 		printf("global %.3f ms offset %.3f ms\n", globalTime,
 			DRIFTsync_offset(sync));
+		if (options.coarseInterval > 0) {
+			printf("coarse global %.3f ms lag %.3f ms\n",
+				DRIFTsync_globalTimeCoarse(sync), DRIFTsync_coarseLag(sync));
+		}
+		if (DRIFTsync_wallClockOffset(sync) != 0) {
+			printf("wall clock %.3f ms %s\n", DRIFTsync_wallClockTime(sync),
+				DRIFTsync_wallClockIsTAI(sync) ? "TAI" : "UTC");
+		}
+		int state = DRIFTsync_state(sync);
+		printf("state %s error bound %.3f ms\n",
+			state == STATE_LOCKED ? "locked"
+				: state == STATE_HOLDOVER ? "holdover" : "unsynchronized",
+			DRIFTsync_errorBound(sync));
 		printf("clock rate %.9f %.9f\n", DRIFTsync_clockRate(sync),
 			DRIFTsync_suggestPlaybackRate(sync, globalTime, 0));
 		printf("median round trip time %.3f ms\n",
 			DRIFTsync_medianRoundTripTime(sync));
-		printf("sent %d lost %d rejected %d\n",
+		printf("sent %d lost %d rejected %d epoch changes %d\n",
 			stats.sentRequests, stats.sentRequests - stats.receivedSamples,
-			stats.rejectedSamples);
+			stats.rejectedSamples, stats.epochChanges);
+		if (options.peerPort > 0)
+			printf("served %d peer requests\n", stats.servedRequests);
+		struct path_statistics path;
+		for (size_t i = 0; DRIFTsync_pathStatistics(sync, i, &path) == 0; i++) {
+			printf("path %s%s sent %d received %d round trip time %.3f ms"
+				" offset %.3f ms deviation %.3f ms\n", path.name,
+				path.active ? " (active)" : "", path.sentRequests,
+				path.receivedSamples, path.roundTripTime, path.offset,
+				path.deviation);
+		}
 		printf("accuracy min %.3f ms average %.3f ms max %.3f ms\n\n",
 			accuracy.min, accuracy.average, accuracy.max);
 		fflush(stdout);
@@ -623,3 +4244,4 @@ main(int argc, char *argv[])
 
 	return 0;
 }
+#endif // DRIFTSYNC_NO_MAIN
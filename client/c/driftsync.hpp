@@ -0,0 +1,76 @@
+#ifndef DRIFTSYNC_HPP
+#define DRIFTSYNC_HPP
+
+// Header only C++17 interface to the global time of the C client, for use with
+// std::chrono and everything taking a Clock like std::this_thread::sleep_until
+// or std::condition_variable::wait_until. Link with driftsync.c built with
+// -DDRIFTSYNC_NO_MAIN.
+//
+//	DRIFTsync *sync = DRIFTsync_create("localhost", DRIFTSYNC_PORT, 1.0,
+//		5000 * 1000, 0);
+//	driftsync::attach(sync);
+//	std::this_thread::sleep_until(driftsync::global_clock<std::nano>::now()
+//		+ std::chrono::milliseconds(100));
+
+#include <driftsync.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ratio>
+
+
+extern "C" {
+	struct DRIFTsync;
+
+	struct DRIFTsync *DRIFTsync_create(const char *server, uint16_t port,
+		double scale, int interval, int measureAccuracy);
+	void DRIFTsync_quit(struct DRIFTsync *sync);
+	int64_t DRIFTsync_globalTimeMicroseconds(struct DRIFTsync *sync);
+}
+
+
+namespace driftsync {
+
+
+// The sync all global clocks read from, shared by all periods.
+inline std::atomic<DRIFTsync *> instance{nullptr};
+
+
+inline void
+attach(DRIFTsync *sync)
+{
+	instance.store(sync, std::memory_order_release);
+}
+
+
+// The global time with integer durations of the given period, for example
+// std::nano or std::micro. The conversion from the microseconds of the
+// protocol is resolved at compile time. The time is 0 until the first
+// synchronization, it is not steady as it steps when the server restarts.
+
+template<typename Period = std::micro>
+struct global_clock {
+	using rep = int64_t;
+	using period = Period;
+	using duration = std::chrono::duration<rep, period>;
+	using time_point = std::chrono::time_point<global_clock, duration>;
+
+	static constexpr bool is_steady = false;
+
+	static time_point
+	now() noexcept
+	{
+		DRIFTsync *sync = instance.load(std::memory_order_acquire);
+		if (sync == nullptr)
+			return time_point();
+
+		return time_point(std::chrono::duration_cast<duration>(
+			std::chrono::microseconds(DRIFTsync_globalTimeMicroseconds(sync))));
+	}
+};
+
+
+} // namespace driftsync
+
+#endif // DRIFTSYNC_HPP
@@ -0,0 +1,81 @@
+#!/bin/sh
+
+# Runs the server in a network namespace reachable over two veth paths, the
+# requests on path b queued behind a saturated 1 Mbit/s token bucket. Drops a
+# reply of path a, then takes it down for good and reports the switch to path
+# b with the offsets before and after it. The step between the two is slewed
+# out instead of jumping. Needs root, iproute2 and python3, run from this
+# directory after make.
+
+set -e
+
+SERVER=10.0.9.1
+LOG=${LOG:-/tmp/paths-test.log}
+
+cleanup() {
+	[ -n "$CLIENT" ] && kill $CLIENT 2>/dev/null
+	[ -n "$FLOOD" ] && kill $FLOOD 2>/dev/null
+	ip netns pids driftsync-test 2>/dev/null | xargs -r kill
+	ip link del pa0 2>/dev/null || true
+	ip link del pb0 2>/dev/null || true
+	ip netns del driftsync-test 2>/dev/null || true
+}
+
+trap cleanup EXIT INT TERM
+
+ip netns add driftsync-test
+ip netns exec driftsync-test ip link set lo up
+ip netns exec driftsync-test ip addr add $SERVER/32 dev lo
+
+for path in a:1 b:2; do
+	name=p${path%:*}
+	net=10.0.${path#*:}
+	ip link add ${name}0 type veth peer name ${name}1
+	ip link set ${name}1 netns driftsync-test
+	ip addr add $net.1/24 dev ${name}0
+	ip link set ${name}0 up
+	ip netns exec driftsync-test ip addr add $net.2/24 dev ${name}1
+	ip netns exec driftsync-test ip link set ${name}1 up
+	ip route add $SERVER via $net.2 dev ${name}0 metric ${path#*:}
+done
+
+# Only delays the requests, netem is not needed for that.
+tc qdisc add dev pb0 root tbf rate 1mbit burst 1600 latency 20ms
+python3 -c '
+import socket
+flood = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+flood.setsockopt(socket.SOL_SOCKET, socket.SO_BINDTODEVICE, b"pb0")
+while True:
+	try:
+		flood.sendto(bytes(1000), ("10.0.2.2", 9))
+	except OSError:
+		pass
+' &
+FLOOD=$!
+
+ip netns exec driftsync-test ../../server/driftsync_server > /dev/null &
+sleep 1
+
+./driftsync $SERVER --paths pa0,pb0 > $LOG &
+CLIENT=$!
+sleep 25
+
+# A lost reply stays within the three request intervals of the active path.
+echo "dropping replies of path pa0 for 4 s"
+ip netns exec driftsync-test ip link set pa1 down
+sleep 4
+ip netns exec driftsync-test ip link set pa1 up
+sleep 20
+if grep -q '^switching' $LOG; then
+	echo "switched on a single loss"
+	exit 1
+fi
+
+echo "taking down path pa0"
+ip netns exec driftsync-test ip link set pa1 down
+sleep 30
+
+awk '/^global/ { last = $0 }
+	/^switching/ { print; print "before " last; getline; print "after " $0 }' \
+	$LOG | grep . || { echo "no switch"; exit 1; }
+grep '^path pb0' $LOG | tail -n 1
@@ -1,28 +1,43 @@
 using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
 using System.Linq;
 using System.Net;
 using System.Net.Sockets;
 using System.Threading;
+using System.Threading.Tasks;
 
 
 public class DRIFTsync {
 	private static UInt32 DRIFTSYNC_MAGIC = 0x74667264; // 'drft'
 	private static UInt32 DRIFTSYNC_FLAG_REPLY = (1 << 0);
+	private static UInt32 DRIFTSYNC_FLAG_WALL_CLOCK = (1 << 2);
 	private static int DRIFTSYNC_PACKET_LENGTH = 32;
+	private static int DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH = 40;
 
 	private struct Sample {
 		public long local;
 		public long remote;
 	};
 
+	// Immutable snapshot of everything needed for the global time, replaced
+	// as a whole on every update so that it can be read without locking.
+	private class Estimate {
+		public long reference;
+		public long offset;
+		public double clockRate;
+		public long wallClockOffset;
+	};
+
 	private int maxSamples = 10;
 	private List<long> roundTripTimes = new List<long>();
 	private List<Sample> samples = new List<Sample>();
 	private double currentClockRate = 1;
 	private List<long> offsets = new List<long>();
 	private long averageOffset = 0;
+	private long wallClockOffset = 0;
+	private volatile Estimate estimate = null;
 	private int sentRequests = 0;
 	private int receivedSamples = 0;
 	private int rejectedSamples = 0;
@@ -55,6 +70,9 @@ public class DRIFTsync {
 	public double scale = 0;
 	public bool measureAccuracy = false;
 
+	// Raised from the receive thread whenever the estimate changed.
+	public event Action estimateChanged;
+
 
 	public DRIFTsync(string server, int port = 4318, double scale = SCALE_US,
 		int interval = 5000, bool measureAccuracy = false)
@@ -111,6 +129,21 @@ public class DRIFTsync {
 		return _globalTime() * scale;
 	}
 
+	// Unscaled for adapters, the global time in microseconds and the wall
+	// clock time in microseconds since the Unix epoch. Both are 0 until synced,
+	// the wall clock time also when the server does not provide it.
+	public long globalTimeMicroseconds() {
+		return _globalTime();
+	}
+
+	public long wallClockTimeMicroseconds() {
+		Estimate estimate = this.estimate;
+		if (estimate == null || estimate.wallClockOffset == 0)
+			return 0;
+
+		return _globalTime() + estimate.wallClockOffset;
+	}
+
 	public double offset {
 		get { return averageOffset * scale; }
 	}
@@ -174,14 +207,13 @@ public class DRIFTsync {
 	}
 
 	private long _globalTime() {
-		lock(this) {
-			if (samples.Count == 0)
-				return 0;
+		Estimate estimate = this.estimate;
+		if (estimate == null)
+			return 0;
 
-			long reference = samples[samples.Count - 1].local;
-			return reference + averageOffset
-				+ (long)((double)(_localTime() - reference) * currentClockRate);
-		}
+		long reference = estimate.reference;
+		return reference + estimate.offset
+			+ (long)((double)(_localTime() - reference) * estimate.clockRate);
 	}
 
 	private long _medianRoundTripTime() {
@@ -202,12 +234,12 @@ public class DRIFTsync {
 	}
 
 	private void RequestLoop() {
-		byte[] buffer = new byte[DRIFTSYNC_PACKET_LENGTH];
+		byte[] buffer = new byte[DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH];
 		MemoryStream stream = new MemoryStream(buffer);
 		BinaryWriter writer = new BinaryWriter(stream);
 
 		writer.Write(DRIFTSYNC_MAGIC);
-		writer.Write((UInt32)0);
+		writer.Write(DRIFTSYNC_FLAG_WALL_CLOCK);
 
 		while (!quitting) {
 			sentRequests++;
@@ -220,7 +252,10 @@ public class DRIFTsync {
 			} catch (Exception) {
 			}
 
-			Thread.Sleep(interval);
+			try {
+				Thread.Sleep(interval);
+			} catch (ThreadInterruptedException) {
+			}
 		}
 	}
 
@@ -228,29 +263,46 @@ public class DRIFTsync {
 		IPEndPoint ipEndpoint = new IPEndPoint(IPAddress.Any, 0);
 		EndPoint endpoint = (EndPoint)ipEndpoint;
 
-		byte[] buffer = new byte[DRIFTSYNC_PACKET_LENGTH];
+		byte[] buffer = new byte[DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH];
 		MemoryStream stream = new MemoryStream(buffer);
 		BinaryReader reader = new BinaryReader(stream);
 
 		while (!quitting) {
-			int received = socket.ReceiveFrom(buffer, ref endpoint);
+			int received = 0;
+			try {
+				received = socket.ReceiveFrom(buffer, ref endpoint);
+			} catch (SocketException) {
+			} catch (ObjectDisposedException) {
+			}
+
 			long now = _localTime();
 
 			if (quitting)
 				break;
 
-			if (received != DRIFTSYNC_PACKET_LENGTH)
+			if (received != DRIFTSYNC_PACKET_LENGTH
+				&& received != DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH) {
 				continue;
+			}
 
 			stream.Position = 0;
 			if (reader.ReadUInt32() != DRIFTSYNC_MAGIC)
 				continue;
 
-			if ((reader.ReadUInt32() & DRIFTSYNC_FLAG_REPLY) == 0)
+			UInt32 flags = reader.ReadUInt32();
+			if ((flags & DRIFTSYNC_FLAG_REPLY) == 0)
 				continue;
 
 			long local = reader.ReadInt64();
 			long remote = reader.ReadInt64();
+			reader.ReadInt64(); // epoch
+
+			// Servers without wall clock support reply with the basic packet.
+			long serverWallClockOffset = 0;
+			if (received == DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH
+				&& (flags & DRIFTSYNC_FLAG_WALL_CLOCK) != 0) {
+				serverWallClockOffset = reader.ReadInt64();
+			}
 
 			long localTime = 0;
 			long globalTime = 0;
@@ -261,6 +313,7 @@ public class DRIFTsync {
 
 			lock (this) {
 				receivedSamples++;
+				wallClockOffset = serverWallClockOffset;
 
 				long roundTripTime = now - local;
 				push(roundTripTimes, roundTripTime);
@@ -278,8 +331,17 @@ public class DRIFTsync {
 
 				push(offsets, remote - local);
 				averageOffset = offsets.Sum() / offsets.Count;
+
+				estimate = new Estimate() {
+					reference = local,
+					offset = averageOffset,
+					clockRate = currentClockRate,
+					wallClockOffset = wallClockOffset
+				};
 			}
 
+			estimateChanged?.Invoke();
+
 			if (measureAccuracy && samples.Count > 1) {
 				globalTime -= _globalTime();
 				localTime -= _localTime();
@@ -303,6 +365,13 @@ public class DRIFTsync {
 			}
 		}
 
+		if (args.Contains("--timers")) {
+			TimerBenchmark(sync,
+				int.Parse(args[Array.IndexOf(args, "--timers") + 1]));
+			sync.quit();
+			return;
+		}
+
 		int remaining = 0;
 		while (true) {
 			if (remaining != 0 && --remaining == 0) {
@@ -330,4 +399,211 @@ public class DRIFTsync {
 			Console.WriteLine();
 		}
 	}
+
+	// Firing error of global time timers, measured in global time, and the
+	// cost of a synchronized timestamp.
+	private static void TimerBenchmark(DRIFTsync sync, int count) {
+		while (sync.globalTimeMicroseconds() == 0)
+			Thread.Sleep(10);
+
+		DRIFTsyncTimeProvider provider = new DRIFTsyncTimeProvider(sync);
+		long[] lateness = new long[count];
+		ITimer[] timers = new ITimer[count];
+		CountdownEvent done = new CountdownEvent(count);
+
+		long start = provider.GetTimestamp() + 100 * 1000;
+		for (int i = 0; i < count; i++) {
+			int index = i;
+			long deadline = start + i * 10 * 1000;
+			long dueTime = Math.Max(0, deadline - provider.GetTimestamp());
+			timers[i] = provider.CreateTimer(state => {
+					lateness[index] = provider.GetTimestamp() - deadline;
+					done.Signal();
+				}, null, TimeSpan.FromTicks(dueTime * 10),
+				Timeout.InfiniteTimeSpan);
+		}
+
+		done.Wait();
+		foreach (ITimer timer in timers)
+			timer.Dispose();
+
+		int calls = 1000000;
+		long sink = 0;
+		Stopwatch stopwatch = Stopwatch.StartNew();
+		for (int i = 0; i < calls; i++)
+			sink += provider.GetTimestamp();
+		double perCall = stopwatch.Elapsed.TotalMilliseconds * 1000 * 1000
+			/ calls;
+
+		Console.WriteLine($"timers {count} lateness min {lateness.Min()} us"
+			+ $" average {lateness.Average():f1} us max {lateness.Max()} us"
+			+ $" timestamp {perCall:f1} ns");
+		GC.KeepAlive(sink);
+	}
+}
+
+
+// TimeProvider with synchronized timestamps in microseconds of global time and
+// the wall clock of the server as UTC when it provides it. Timers fire at
+// deadlines in global time, relative to the global time when they are created
+// or changed, so they should only be created once synchronized. Pending
+// deadlines are projected to local time anew whenever the estimate changes.
+// Callbacks run on the thread pool like those of the system timers.
+
+public class DRIFTsyncTimeProvider : TimeProvider {
+	private DRIFTsync sync = null;
+	private List<GlobalTimer> timers = new List<GlobalTimer>();
+	private Thread timerThread = null;
+
+	private class GlobalTimer : ITimer {
+		public DRIFTsyncTimeProvider provider;
+		public TimerCallback callback;
+		public object state;
+		public long deadline;
+		public long period;
+		public bool disposed;
+
+		public bool Change(TimeSpan dueTime, TimeSpan period) {
+			return provider.Change(this, dueTime, period);
+		}
+
+		public void Dispose() {
+			provider.Remove(this);
+		}
+
+		public ValueTask DisposeAsync() {
+			Dispose();
+			return default;
+		}
+	};
+
+	public DRIFTsyncTimeProvider(DRIFTsync sync) {
+		this.sync = sync;
+		sync.estimateChanged += () => {
+			lock(timers) {
+				Monitor.PulseAll(timers);
+			}
+		};
+	}
+
+	public override long TimestampFrequency {
+		get { return 1000 * 1000; }
+	}
+
+	public override long GetTimestamp() {
+		return sync.globalTimeMicroseconds();
+	}
+
+	public override DateTimeOffset GetUtcNow() {
+		long wallClockTime = sync.wallClockTimeMicroseconds();
+		if (wallClockTime == 0)
+			return base.GetUtcNow();
+
+		return DateTimeOffset.UnixEpoch.AddTicks(wallClockTime * 10);
+	}
+
+	public override ITimer CreateTimer(TimerCallback callback, object state,
+		TimeSpan dueTime, TimeSpan period) {
+
+		if (callback == null)
+			throw new ArgumentNullException(nameof(callback));
+
+		GlobalTimer timer = new GlobalTimer() {
+			provider = this,
+			callback = callback,
+			state = state
+		};
+
+		Change(timer, dueTime, period);
+		return timer;
+	}
+
+	private static long Microseconds(TimeSpan span, string name) {
+		if (span == Timeout.InfiniteTimeSpan)
+			return -1;
+
+		if (span < TimeSpan.Zero)
+			throw new ArgumentOutOfRangeException(name);
+
+		return span.Ticks / 10;
+	}
+
+	private bool Change(GlobalTimer timer, TimeSpan dueTime, TimeSpan period) {
+		long due = Microseconds(dueTime, nameof(dueTime));
+		long interval = Microseconds(period, nameof(period));
+
+		lock(timers) {
+			if (timer.disposed)
+				return false;
+
+			timers.Remove(timer);
+			if (due < 0)
+				return true;
+
+			timer.deadline = sync.globalTimeMicroseconds() + due;
+			timer.period = interval > 0 ? interval : 0;
+			timers.Add(timer);
+
+			if (timerThread == null) {
+				timerThread = new Thread(new ThreadStart(TimerLoop));
+				timerThread.IsBackground = true;
+				timerThread.Start();
+			}
+
+			Monitor.PulseAll(timers);
+		}
+
+		return true;
+	}
+
+	private void Remove(GlobalTimer timer) {
+		lock(timers) {
+			timer.disposed = true;
+			timers.Remove(timer);
+			Monitor.PulseAll(timers);
+		}
+	}
+
+	private void TimerLoop() {
+		lock(timers) {
+			while (true) {
+				long now = sync.globalTimeMicroseconds();
+				long next = long.MaxValue;
+
+				for (int i = timers.Count - 1; i >= 0; i--) {
+					GlobalTimer timer = timers[i];
+					if (timer.deadline > now) {
+						next = Math.Min(next, timer.deadline);
+						continue;
+					}
+
+					ThreadPool.QueueUserWorkItem(
+						state => timer.callback(state), timer.state);
+
+					if (timer.period == 0) {
+						timers.RemoveAt(i);
+						continue;
+					}
+
+					// Like the system timers, missed periods are not caught up.
+					timer.deadline += timer.period;
+					if (timer.deadline <= now)
+						timer.deadline = now + timer.period;
+
+					next = Math.Min(next, timer.deadline);
+				}
+
+				if (next == long.MaxValue) {
+					Monitor.Wait(timers);
+					continue;
+				}
+
+				// The wait is projected with the current estimate and ends
+				// early when it changes. It has millisecond resolution, so
+				// the last millisecond before a deadline is spent yielding.
+				long wait = (long)((next - now) / sync.clockRate / 1000);
+				Monitor.Wait(timers, (int)Math.Min(wait, int.MaxValue));
+			}
+		}
+	}
 }
@@ -0,0 +1,532 @@
+package org.driftsync
+
+import java.net.InetAddress
+import java.net.DatagramPacket
+import java.net.DatagramSocket
+import java.net.SocketException
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.time.Clock
+import java.time.Instant
+import java.time.ZoneId
+import java.time.ZoneOffset
+import java.util.PriorityQueue
+import java.util.concurrent.AbstractExecutorService
+import java.util.concurrent.Callable
+import java.util.concurrent.CopyOnWriteArrayList
+import java.util.concurrent.CountDownLatch
+import java.util.concurrent.Delayed
+import java.util.concurrent.Executors
+import java.util.concurrent.FutureTask
+import java.util.concurrent.RejectedExecutionException
+import java.util.concurrent.RunnableScheduledFuture
+import java.util.concurrent.ScheduledExecutorService
+import java.util.concurrent.ScheduledFuture
+import java.util.concurrent.locks.ReentrantLock
+import java.util.concurrent.TimeUnit
+
+import kotlin.concurrent.thread
+import kotlin.concurrent.withLock
+import kotlin.math.abs
+import kotlin.math.max
+import kotlin.math.min
+
+
+val SCALE_US = 1.0
+val SCALE_MS = SCALE_US / 1000
+val SCALE_S = SCALE_MS / 1000
+
+class DRIFTsync(
+	val server: String,
+	val port: Int = 4318,
+	var scale: Double = 1.0,
+	var interval: Long = 5000,
+	var measureAccuracy: Boolean = false
+) {
+
+	private class Sample(val local: Long, val remote: Long)
+
+	// Immutable snapshot of everything needed for the global time, replaced
+	// as a whole on every update so that it can be read without locking.
+	private class Estimate(
+		val reference: Long,
+		val offset: Long,
+		val clockRate: Double,
+		val wallClockOffset: Long,
+		val valid: Boolean
+	)
+
+	class Statistics(
+		val sent: Int,
+		val received: Int,
+		val rejected: Int
+	)
+
+	class Accuracy(val min: Double, val average: Double, val max: Double)
+
+	private val DRIFTSYNC_MAGIC = 0x74667264 // 'drft'
+	private val DRIFTSYNC_FLAG_REPLY = 1
+	private val DRIFTSYNC_FLAG_WALL_CLOCK = 1 shl 2
+	private val DRIFTSYNC_PACKET_LENGTH = 32
+	private val DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH = 40
+
+	private val maxSamples = 10
+	private var roundTripTimes : MutableList<Long> = mutableListOf()
+	private var samples: MutableList<Sample> = mutableListOf()
+	private var currentClockRate: Double = 1.0
+	private var offsets: MutableList<Long> = mutableListOf()
+	private var averageOffset: Long = 0
+	private var wallClockOffset: Long = 0
+	@Volatile private var estimate = Estimate(0, 0, 1.0, 0, false)
+	private val estimateListeners = CopyOnWriteArrayList<() -> Unit>()
+	private var sentRequests = 0
+	private var receivedSamples = 0
+	private var rejectedSamples = 0
+	private var accuracySamples: MutableList<Long> = mutableListOf()
+	private var quitting = false
+
+	private val socket = DatagramSocket()
+	private val lock = ReentrantLock()
+	private val condition = lock.newCondition()
+
+	fun localTime() = _localTime() * scale
+	fun globalTime() = _globalTime() * scale
+
+	// Unscaled for adapters, the global time in microseconds and the wall
+	// clock time in microseconds since the Unix epoch, which is the global time
+	// when the server does not provide its wall clock. Both 0 until synced.
+	fun globalTimeMicros() = _globalTime()
+
+	fun wallClockTimeMicros(): Long {
+		val globalTime = _globalTime()
+		if (globalTime == 0L)
+			return 0
+
+		return globalTime + estimate.wallClockOffset
+	}
+
+	// Called from the receive thread whenever the estimate changed.
+	fun addEstimateListener(listener: () -> Unit) {
+		estimateListeners.add(listener)
+	}
+
+	fun removeEstimateListener(listener: () -> Unit) {
+		estimateListeners.remove(listener)
+	}
+
+	val offset get() = averageOffset * scale
+	val clockRate get() = currentClockRate
+
+	fun suggestPlaybackRate(
+		globalStartTime: Double, playbackPosition: Double
+	): Double {
+		val globalPosition = _globalTime() - (globalStartTime / scale).toLong()
+		val difference = globalPosition - playbackPosition / scale
+		if (abs(difference) < 5000)
+			return 1.0
+
+		return min(2.0, max(0.5, 1.0 + difference / 1000 / 1000))
+	}
+
+	fun medianRoundTripTime() = _medianRoundTripTime() * scale
+
+	val statistics
+		get() = Statistics(sentRequests, receivedSamples, rejectedSamples)
+
+	fun accuracy(
+		wait: Boolean = false,
+		reset: Boolean = false,
+		timeout: Long = 15000
+	): Accuracy {
+		val empty = Accuracy(0.0, 0.0, 0.0)
+		if (!measureAccuracy)
+			return empty
+
+		lock.withLock {
+			if (reset)
+				accuracySamples.clear()
+
+			if (wait && !condition.await(timeout, TimeUnit.MILLISECONDS))
+				return empty
+
+			if (accuracySamples.isNullOrEmpty())
+				return empty
+
+			return Accuracy(accuracySamples.minOrNull()!!.toDouble() * scale,
+				accuracySamples.average() * scale,
+				accuracySamples.maxOrNull()!!.toDouble() * scale)
+		}
+	}
+
+	private fun _localTime() = System.nanoTime() / 1000
+
+	private fun _globalTime(): Long {
+		val estimate = estimate
+		if (!estimate.valid)
+			return 0
+
+		val reference = estimate.reference
+		return (reference + estimate.offset + (_localTime() - reference)
+				* estimate.clockRate).toLong()
+	}
+
+	private fun _medianRoundTripTime(): Long {
+		lock.withLock {
+			if (roundTripTimes.size == 0)
+				return 0
+			return roundTripTimes.sorted()[roundTripTimes.size / 2]
+		}
+	}
+
+	private fun <T: Any> _push(data: MutableList<T>, value: T) {
+		if (data.size >= maxSamples)
+			data.removeAt(0)
+		data.add(value)
+	}
+
+	private val requestThread = thread() {
+		val address = InetAddress.getByName(server)
+		var buffer = ByteBuffer.allocate(DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH)
+		var packet = DatagramPacket(buffer.array(),
+			DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH, address, port)
+
+		buffer.order(ByteOrder.LITTLE_ENDIAN)
+		buffer.putInt(DRIFTSYNC_MAGIC)
+		buffer.putInt(DRIFTSYNC_FLAG_WALL_CLOCK)
+		buffer.mark()
+
+		while (!quitting) {
+			sentRequests++
+			buffer.reset()
+			buffer.putLong(_localTime())
+			socket.send(packet)
+
+			try {
+				Thread.sleep(interval)
+			} catch (exception: InterruptedException) {
+			}
+		}
+	}
+
+	private val receiveThread = thread() {
+		var buffer = ByteBuffer.allocate(DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH)
+		var packet = DatagramPacket(buffer.array(),
+			DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH)
+
+		buffer.order(ByteOrder.LITTLE_ENDIAN)
+
+		while (!quitting) {
+			try {
+				packet.length = DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH
+				socket.receive(packet)
+			} catch (exception: SocketException) {
+			}
+
+			val now = _localTime()
+
+			if (quitting)
+				break
+
+			if (packet.length != DRIFTSYNC_PACKET_LENGTH
+				&& packet.length != DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH) {
+				continue
+			}
+
+			buffer.rewind()
+			if (buffer.getInt() != DRIFTSYNC_MAGIC)
+				continue
+
+			val flags = buffer.getInt()
+			if ((flags and DRIFTSYNC_FLAG_REPLY) == 0)
+				continue
+
+			val local = buffer.getLong()
+			val remote = buffer.getLong()
+			buffer.getLong() // epoch
+
+			// Servers without wall clock support reply with the basic packet.
+			val serverWallClockOffset: Long
+				= if (packet.length == DRIFTSYNC_WALL_CLOCK_PACKET_LENGTH
+					&& (flags and DRIFTSYNC_FLAG_WALL_CLOCK) != 0)
+					buffer.getLong() else 0
+
+			var localTime: Long = 0
+			var globalTime: Long = 0
+			if (measureAccuracy) {
+				localTime = _localTime()
+				globalTime = _globalTime()
+			}
+
+			var updated = false
+			lock.withLock {
+				receivedSamples++
+				wallClockOffset = serverWallClockOffset
+
+				val roundTripTime = now - local
+				_push(roundTripTimes, roundTripTime)
+				if (abs(roundTripTime - _medianRoundTripTime()) > 10000) {
+					rejectedSamples++
+				} else {
+					_push(samples, Sample(local, remote))
+					if (samples.size >= 2) {
+						val last = samples[samples.lastIndex]
+						currentClockRate = ((last.remote - samples[0].remote)
+								.toDouble() / (last.local - samples[0].local))
+					}
+
+					_push(offsets, remote - local)
+					averageOffset = offsets.average().toLong()
+
+					estimate = Estimate(local, averageOffset, currentClockRate,
+						wallClockOffset, true)
+					updated = true
+				}
+			}
+
+			if (updated)
+				estimateListeners.forEach { it() }
+
+			if (measureAccuracy && samples.size > 1) {
+				globalTime -= _globalTime()
+				localTime -= _localTime()
+
+				lock.withLock {
+					_push(accuracySamples, abs(globalTime - localTime))
+					condition.signalAll()
+				}
+			}
+		}
+	}
+
+	fun quit() {
+		lock.withLock {
+			quitting = true
+			condition.signalAll()
+		}
+
+		socket.close()
+
+		requestThread.interrupt()
+		receiveThread.interrupt()
+
+		requestThread.join()
+		receiveThread.join()
+	}
+}
+
+// java.time clock of the wall clock time of the server. Without wall clock
+// support on the server, the instants count from the start of its time base.
+
+class DRIFTsyncClock(
+	private val sync: DRIFTsync,
+	private val zone: ZoneId = ZoneOffset.UTC
+) : Clock() {
+
+	override fun getZone() = zone
+
+	override fun withZone(zone: ZoneId): Clock
+		= if (zone == this.zone) this else DRIFTsyncClock(sync, zone)
+
+	override fun instant(): Instant {
+		val micros = sync.wallClockTimeMicros()
+		return Instant.ofEpochSecond(Math.floorDiv(micros, 1000000L),
+			Math.floorMod(micros, 1000000L) * 1000)
+	}
+
+	override fun millis() = Math.floorDiv(sync.wallClockTimeMicros(), 1000L)
+}
+
+
+// Runs tasks on a single thread at deadlines in global time. Delays are
+// relative to the current global time, so tasks should only be scheduled once
+// synchronized. The deadlines of pending tasks are projected to local time
+// anew whenever the estimate changes.
+
+class GlobalTimeScheduledExecutor(val sync: DRIFTsync)
+	: AbstractExecutorService(), ScheduledExecutorService {
+
+	private inner class Task<V>(
+		callable: Callable<V>,
+		var deadline: Long,
+		val period: Long
+	) : FutureTask<V>(callable), RunnableScheduledFuture<V> {
+
+		override fun getDelay(unit: TimeUnit) = unit.convert(
+			deadline - sync.globalTimeMicros(), TimeUnit.MICROSECONDS)
+
+		override fun compareTo(other: Delayed): Int {
+			if (other is Task<*>)
+				return deadline.compareTo(other.deadline)
+
+			return getDelay(TimeUnit.MICROSECONDS)
+				.compareTo(other.getDelay(TimeUnit.MICROSECONDS))
+		}
+
+		override fun isPeriodic() = period != 0L
+
+		override fun run() {
+			if (!isPeriodic()) {
+				super<FutureTask>.run()
+				return
+			}
+
+			// A negative period is a fixed delay after each run.
+			if (runAndReset()) {
+				deadline = if (period > 0) deadline + period
+					else sync.globalTimeMicros() - period
+				requeue(this)
+			}
+		}
+
+		override fun cancel(mayInterruptIfRunning: Boolean): Boolean {
+			val result = super<FutureTask>.cancel(mayInterruptIfRunning)
+			if (result)
+				dequeue(this)
+			return result
+		}
+	}
+
+	private val lock = ReentrantLock()
+	private val condition = lock.newCondition()
+	private val queue = PriorityQueue<Task<*>>()
+	private var shutdown = false
+	private val terminated = CountDownLatch(1)
+	private val listener: () -> Unit = {
+		lock.withLock { condition.signalAll() }
+	}
+
+	private val worker = thread(isDaemon = true, name = "driftsync-scheduler") {
+		lock.lock()
+		try {
+			while (true) {
+				val next = queue.peek()
+				if (next == null) {
+					if (shutdown)
+						break
+
+					condition.await()
+					continue
+				}
+
+				// Changes of the estimate wake this up to project the deadline
+				// with the new one.
+				val delay = next.getDelay(TimeUnit.NANOSECONDS)
+				if (delay > 0) {
+					condition.awaitNanos(delay)
+					continue
+				}
+
+				queue.poll()
+				lock.unlock()
+				try {
+					next.run()
+				} finally {
+					lock.lock()
+				}
+			}
+		} catch (exception: InterruptedException) {
+		} finally {
+			lock.unlock()
+			sync.removeEstimateListener(listener)
+			terminated.countDown()
+		}
+	}
+
+	init {
+		sync.addEstimateListener(listener)
+	}
+
+	fun scheduleAt(globalTime: Double, command: Runnable): ScheduledFuture<*>
+		= enqueue(Task(Executors.callable(command),
+			(globalTime / sync.scale).toLong(), 0))
+
+	override fun schedule(command: Runnable, delay: Long, unit: TimeUnit)
+		: ScheduledFuture<*>
+		= enqueue(Task(Executors.callable(command), deadlineAfter(delay, unit),
+			0))
+
+	override fun <V> schedule(callable: Callable<V>, delay: Long,
+		unit: TimeUnit): ScheduledFuture<V>
+		= enqueue(Task(callable, deadlineAfter(delay, unit), 0))
+
+	override fun scheduleAtFixedRate(command: Runnable, initialDelay: Long,
+		period: Long, unit: TimeUnit): ScheduledFuture<*> {
+		if (unit.toMicros(period) <= 0)
+			throw IllegalArgumentException("period must be positive")
+
+		return enqueue(Task(Executors.callable(command),
+			deadlineAfter(initialDelay, unit), unit.toMicros(period)))
+	}
+
+	override fun scheduleWithFixedDelay(command: Runnable, initialDelay: Long,
+		delay: Long, unit: TimeUnit): ScheduledFuture<*> {
+		if (unit.toMicros(delay) <= 0)
+			throw IllegalArgumentException("delay must be positive")
+
+		return enqueue(Task(Executors.callable(command),
+			deadlineAfter(initialDelay, unit), -unit.toMicros(delay)))
+	}
+
+	override fun execute(command: Runnable) {
+		schedule(command, 0, TimeUnit.MICROSECONDS)
+	}
+
+	override fun shutdown() {
+		lock.withLock {
+			shutdown = true
+			queue.filter { it.isPeriodic() }.forEach {
+				queue.remove(it)
+				it.cancel(false)
+			}
+			condition.signalAll()
+		}
+	}
+
+	override fun shutdownNow(): MutableList<Runnable> {
+		lock.withLock {
+			shutdown = true
+			val pending = ArrayList<Runnable>(queue)
+			queue.clear()
+			condition.signalAll()
+			worker.interrupt()
+			return pending
+		}
+	}
+
+	override fun isShutdown() = lock.withLock { shutdown }
+
+	override fun isTerminated() = terminated.count == 0L
+
+	override fun awaitTermination(timeout: Long, unit: TimeUnit)
+		= terminated.await(timeout, unit)
+
+	private fun deadlineAfter(delay: Long, unit: TimeUnit)
+		= sync.globalTimeMicros() + unit.toMicros(delay)
+
+	private fun <V> enqueue(task: Task<V>): Task<V> {
+		lock.withLock {
+			if (shutdown)
+				throw RejectedExecutionException("executor is shut down")
+
+			queue.add(task)
+			condition.signalAll()
+		}
+
+		return task
+	}
+
+	private fun requeue(task: Task<*>) {
+		lock.withLock {
+			if (!shutdown) {
+				queue.add(task)
+				condition.signalAll()
+			}
+		}
+	}
+
+	private fun dequeue(task: Task<*>) {
+		lock.withLock {
+			queue.remove(task)
+		}
+	}
+}
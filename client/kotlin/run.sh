@@ -1,4 +1,5 @@
 #!/bin/sh
 
-docker run -it --rm --init -v $PWD:/source zenika/kotlin \
-	kotlinc -script /source/driftsync.kts -- $*
+docker run -it --rm --init -v $PWD:/source zenika/kotlin sh -c \
+	"kotlinc /source/driftsync.kt -d /tmp/driftsync.jar \
+	&& kotlinc -cp /tmp/driftsync.jar -script /source/driftsync.kts -- $*"
@@ -19,6 +19,15 @@ class Sample:
 	remote: int
 
 
+# Shared memory layout for publishing the estimate to other processes: the
+# generation, odd while an update is written, followed by the reference local
+# time, the offset and the clock rate.
+_SHARED_FORMAT = '<Qddd'
+_SHARED_LENGTH = struct.calcsize(_SHARED_FORMAT)
+_SHARED_ESTIMATE_OFFSET = struct.calcsize('<Q')
+_SHARED_READ_ATTEMPTS = 100
+
+
 class DRIFTsync(object):
 	_DRIFTSYNC_MAGIC = 0x74667264 # 'drft'
 	_DRIFTSYNC_FLAG_REPLY = (1 << 0)
@@ -26,7 +35,7 @@ class DRIFTsync(object):
 	_DRIFTSYNC_PACKET_LENGTH = struct.calcsize(_DRIFTSYNC_PACKET_FORMAT)
 
 	def __init__(self, server, port=4318, scale=SCALE_US, interval=5,
-			measureAccuracy=False):
+			measureAccuracy=False, sharedMemory=None):
 		self._maxSamples = 10
 		self._roundTripTimes = []
 		self._samples = []
@@ -49,6 +58,14 @@ class DRIFTsync(object):
 		self._interval = interval
 		self._measureAccuracy = measureAccuracy
 
+		self._shared = None
+		self._generation = 0
+		if sharedMemory is not None:
+			from multiprocessing import shared_memory
+			self._shared = shared_memory.SharedMemory(sharedMemory, create=True,
+				size=_SHARED_LENGTH)
+			struct.pack_into(_SHARED_FORMAT, self._shared.buf, 0, 0, 0, 0, 1)
+
 		self._receiveThread = threading.Thread(target=self._receiveLoop)
 		self._receiveThread.start()
 
@@ -72,6 +89,10 @@ class DRIFTsync(object):
 		self._interrupt[0].close()
 		self._interrupt[1].close()
 
+		if self._shared is not None:
+			self._shared.close()
+			self._shared.unlink()
+
 	@property
 	def scale(self):
 		return self._scale
@@ -162,6 +183,16 @@ class DRIFTsync(object):
 			data.pop(0)
 		data.append(value)
 
+	def _publish(self):
+		# Sequence lock, readers retry while the generation is odd or changed.
+		buffer = self._shared.buf
+		self._generation += 1
+		struct.pack_into('<Q', buffer, 0, self._generation)
+		struct.pack_into('<ddd', buffer, _SHARED_ESTIMATE_OFFSET,
+			self._samples[-1].local, self._offset, self._clockRate)
+		self._generation += 1
+		struct.pack_into('<Q', buffer, 0, self._generation)
+
 	def _sendRequest(self):
 		self._sentRequests += 1
 		data = struct.pack(self._DRIFTSYNC_PACKET_FORMAT, self._DRIFTSYNC_MAGIC,
@@ -217,6 +248,9 @@ class DRIFTsync(object):
 				self._push(self._offsets, remote - local)
 				self._offset = sum(self._offsets) / len(self._offsets)
 
+				if self._shared is not None:
+					self._publish()
+
 			if self._measureAccuracy and len(self._samples) > 1:
 				globalTime -= self._globalTime()
 				localTime -= self._localTime()
@@ -226,11 +260,90 @@ class DRIFTsync(object):
 					self._lock.notify()
 
 
+class DRIFTsyncReader(object):
+	"""Global time as published by a DRIFTsync created with sharedMemory in
+	another process on the same host, read without locks or sockets. Relies on
+	the local time base being the same across processes, which it is for the
+	monotonic perf_counter on the common platforms."""
+
+	def __init__(self, sharedMemory, scale=SCALE_US):
+		from multiprocessing import shared_memory
+		try:
+			self._shared = shared_memory.SharedMemory(sharedMemory, track=False)
+		except TypeError:
+			# Before Python 3.13 the resource tracker would remove the segment
+			# of the owner when this process exits.
+			from multiprocessing import resource_tracker
+			self._shared = shared_memory.SharedMemory(sharedMemory)
+			resource_tracker.unregister(self._shared._name, 'shared_memory')
+
+		self._scale = scale
+
+	def close(self):
+		self._shared.close()
+
+	@property
+	def scale(self):
+		return self._scale
+
+	@scale.setter
+	def scale(self, newScale):
+		self._scale = newScale
+
+	def localTime(self):
+		return DRIFTsync._localTime() * self._scale
+
+	def globalTime(self):
+		reference, offset, clockRate = self._read()
+		if reference == 0:
+			return 0
+
+		return (reference + offset
+			+ (DRIFTsync._localTime() - reference) * clockRate) * self._scale
+
+	@property
+	def offset(self):
+		return self._read()[1] * self._scale
+
+	@property
+	def clockRate(self):
+		return self._read()[2]
+
+	def _read(self):
+		# A publisher that died while writing leaves the generation odd for
+		# good, give up after a while and report being unsynchronized.
+		buffer = self._shared.buf
+		for _ in range(_SHARED_READ_ATTEMPTS):
+			generation, reference, offset, clockRate \
+				= struct.unpack_from(_SHARED_FORMAT, buffer, 0)
+			if generation % 2 == 0 \
+					and struct.unpack_from('<Q', buffer, 0)[0] == generation:
+				return reference, offset, clockRate
+
+			# Let the publisher finish its update.
+			time.sleep(0)
+
+		return 0, 0, 1
+
+
 if __name__ == '__main__':
 	import sys
 
+	if '--read' in sys.argv:
+		reader = DRIFTsyncReader(sys.argv[sys.argv.index('--read') + 1],
+			scale=SCALE_MS)
+		while True:
+			print(f'global {reader.globalTime():.3f} ms'
+				f' offset {reader.offset:.3f} ms'
+				f' clock rate {reader.clockRate:.9f}')
+			time.sleep(1)
+
+	sharedMemory = None
+	if '--publish' in sys.argv:
+		sharedMemory = sys.argv[sys.argv.index('--publish') + 1]
+
 	sync = DRIFTsync(sys.argv[1] if len(sys.argv) > 1 else 'localhost',
-		scale=SCALE_MS, measureAccuracy=True)
+		scale=SCALE_MS, measureAccuracy=True, sharedMemory=sharedMemory)
 
 	if '--stream' in sys.argv:
 		while True:
@@ -4,9 +4,43 @@
 #include <inttypes.h>
 
 #define DRIFTSYNC_PORT			4318
+#define DRIFTSYNC_PEER_PORT		4319
+#define DRIFTSYNC_CUE_PORT		4320
 #define DRIFTSYNC_MAGIC			0x74667264 // 'drft'
 
-#define DRIFTSYNC_FLAG_REPLY	(1 << 0)
+#define DRIFTSYNC_FLAG_REPLY			(1 << 0)
+#define DRIFTSYNC_FLAG_CLOCK_STEPPED	(1 << 1)
+	// set in replies when the epoch was started because the server detected a
+	// discontinuity of its own clock rather than by a server start
+#define DRIFTSYNC_FLAG_WALL_CLOCK		(1 << 2)
+	// set in requests to ask for the wall clock extension, kept in replies only
+	// when the server provides a wall clock offset
+#define DRIFTSYNC_FLAG_WALL_CLOCK_TAI	(1 << 3)
+	// set in replies when the wall clock offset refers to TAI instead of UTC
+#define DRIFTSYNC_FLAG_WAKEUP			(1 << 4)
+	// set in requests that are only sent to wake up the network path ahead of
+	// an actual request, the server does not reply to them
+#define DRIFTSYNC_FLAG_ANNOUNCE			(1 << 5)
+	// set in announcements broadcast by clients in peer mode, local holds the
+	// random node id, remote the port the node answers requests on and epoch
+	// the server epoch the node is synchronized to or 0
+#define DRIFTSYNC_FLAG_TELEMETRY		(1 << 6)
+	// set in requests that carry a struct driftsync_telemetry in place of the
+	// epoch, describing how well the client is synchronized
+#define DRIFTSYNC_FLAG_CUE				(1 << 7)
+	// set in all packets of the cue service, which use struct driftsync_cue
+	// and one of the cue flags below
+
+#define DRIFTSYNC_CUE_SUBSCRIBE			(1 << 8)
+	// sent by subscribers every second to stay subscribed, answered along
+	// with the acknowledge flag, which the subscriber echoes to measure the
+	// round trip time
+#define DRIFTSYNC_CUE_PUBLISH			(1 << 9)
+	// sent by publishers to submit a cue, answered along with the acknowledge
+	// flag and the time the cue was scheduled for or 0 when it was rejected
+#define DRIFTSYNC_CUE_ACKNOWLEDGE		(1 << 10)
+	// set in acknowledgements, cues without any cue flag are deliveries
+#define DRIFTSYNC_CUE_PAYLOAD			256
 
 
 // A single fixed size packet is used here for all operations to avoid an
@@ -23,7 +57,64 @@ struct driftsync_packet {
 	uint64_t	remote;
 		// remote time on reply, ignored in request, filled in reply
 
-	uint64_t	reserved;
+	uint64_t	epoch;
+		// random server epoch on reply, changes whenever the remote time base
+		// is no longer continuous with previous replies; the telemetry in
+		// requests with the telemetry flag, ignored in other requests
+} __attribute__((__packed__));
+
+
+// Summary of the client state sent along with requests, all values saturate
+// at the limits of their type.
+
+struct driftsync_telemetry {
+	int16_t		residual;
+		// difference of the last accepted offset to the average in microseconds
+
+	uint16_t	roundTripTime;
+		// median round trip time in units of 10 microseconds
+
+	uint16_t	rejected;
+		// number of rejected samples, wrapping around
+
+	uint16_t	lost;
+		// number of requests without reply, wrapping around
+} __attribute__((__packed__));
+
+
+// Requests with the wall clock flag set are extended by the wall clock offset,
+// the reply mirrors the request size to keep the packets symmetric.
+
+struct driftsync_wall_clock_packet {
+	struct driftsync_packet	packet;
+
+	int64_t		wallClockOffset;
+		// server wall clock minus remote time on reply, ignored in request
+} __attribute__((__packed__));
+
+
+// Packet of the cue service, sent only as long as the payload it contains.
+
+struct driftsync_cue {
+	uint32_t	magic;
+	uint32_t	flags;
+
+	uint64_t	sequence;
+		// cue number assigned by the service, chosen by the publisher when
+		// publishing to recognize retransmissions
+
+	uint64_t	time;
+		// global time in microseconds the cue is due at, 0 when publishing
+		// to let the service choose it from the round trip times
+
+	uint64_t	sent;
+		// local time of the service on sending, echoed in acknowledgements
+
+	uint16_t	length;
+	uint8_t		payload[DRIFTSYNC_CUE_PAYLOAD];
 } __attribute__((__packed__));
 
+#define DRIFTSYNC_CUE_HEADER_LENGTH \
+	(sizeof(struct driftsync_cue) - DRIFTSYNC_CUE_PAYLOAD)
+
 #endif // DRIFTSYNC_H
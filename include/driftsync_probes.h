@@ -0,0 +1,30 @@
+#ifndef DRIFTSYNC_PROBES_H
+#define DRIFTSYNC_PROBES_H
+
+// USDT probes for tracing the server and client hot paths. When the systemtap
+// headers are available, each probe compiles to a single nop that tools like
+// bpftrace can attach to at runtime. Otherwise, or when DRIFTSYNC_NO_PROBES is
+// defined, the probes compile to nothing.
+
+#if defined(__has_include) && !defined(DRIFTSYNC_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DRIFTSYNC_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef DRIFTSYNC_PROBES_ENABLED
+#define DRIFTSYNC_PROBE(name, ...)	STAP_PROBEV(driftsync, name, __VA_ARGS__)
+#else
+#define DRIFTSYNC_PROBE(name, ...)	do {} while (0)
+#endif
+
+// Reasons passed to the request_drop and reply_drop probes.
+#define DRIFTSYNC_DROP_RECEIVE		1
+#define DRIFTSYNC_DROP_INCOMPLETE	2
+#define DRIFTSYNC_DROP_MAGIC		3
+#define DRIFTSYNC_DROP_FLAGS		4
+#define DRIFTSYNC_DROP_WAKEUP		5
+#define DRIFTSYNC_DROP_STALE		6
+
+#endif // DRIFTSYNC_PROBES_H
@@ -0,0 +1,592 @@
+#include <driftsync.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+#define MAX_SUBSCRIBERS			256
+#define MAX_CUES				256
+#define PUBLICATION_HISTORY		64
+#define SUBSCRIBER_TIMEOUT		(5 * 1000 * 1000)
+	// subscribers renew every second and are dropped after this long
+#define INITIAL_TIMEOUT			(100 * 1000)
+	// retransmission timeout until a round trip time was measured
+#define MIN_TIMEOUT				1000
+#define MAX_TIMEOUT				(1000 * 1000)
+#define MAX_BACKOFF				4
+	// doublings of the retransmission timeout of a single cue
+
+
+// Interface of the C client, linked in built with -DDRIFTSYNC_NO_MAIN. The
+// service synchronizes to the server like any other client, so that it uses
+// the served time base regardless of the server options and host.
+
+struct DRIFTsync;
+
+struct DRIFTsync *DRIFTsync_create(const char *server, uint16_t port,
+	double scale, int interval, int measureAccuracy);
+int64_t DRIFTsync_globalTimeMicroseconds(struct DRIFTsync *sync);
+
+
+struct subscriber {
+	struct sockaddr_in address;
+	int64_t lastSeen;
+		// 0 for unused entries
+	int64_t smoothedRoundTripTime;
+	int64_t roundTripTimeVariation;
+		// both 0 until the first measurement
+};
+
+
+struct delivery {
+	int64_t nextSend;
+	int attempts;
+	int acknowledged;
+};
+
+
+// A cue is kept until it is due, so that subscribers joining in between still
+// receive it, with a delivery for each subscriber entry.
+
+struct cue {
+	uint64_t sequence;
+		// 0 for unused entries
+	int64_t time;
+	uint16_t length;
+	uint8_t payload[DRIFTSYNC_CUE_PAYLOAD];
+	struct delivery deliveries[MAX_SUBSCRIBERS];
+};
+
+
+// Result of a recent publish request, to answer retransmissions of it.
+
+struct publication {
+	struct sockaddr_in address;
+	uint64_t id;
+	int64_t time;
+};
+
+
+struct service {
+	int socket;
+	struct DRIFTsync *sync;
+	int64_t margin;
+	int retransmissions;
+	int verbose;
+	uint64_t nextSequence;
+	struct subscriber subscribers[MAX_SUBSCRIBERS];
+	struct cue cues[MAX_CUES];
+	struct publication publications[PUBLICATION_HISTORY];
+	size_t publicationPosition;
+};
+
+
+static inline int64_t
+localTime()
+{
+	struct timespec time;
+	if (clock_gettime(CLOCK_MONOTONIC, &time) != 0)
+		return 0;
+
+	return (int64_t)time.tv_sec * 1000 * 1000 + time.tv_nsec / 1000;
+}
+
+
+static uint64_t
+randomSequence()
+{
+	// Random start so that subscribers do not confuse the cues of a restarted
+	// service with ones they have already seen.
+	uint64_t sequence = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &sequence, sizeof(sequence)) != (ssize_t)sizeof(sequence))
+			sequence = 0;
+		close(fd);
+	}
+
+	if (sequence == 0) {
+		struct timespec time;
+		clock_gettime(CLOCK_REALTIME, &time);
+		sequence = (uint64_t)time.tv_sec << 32 ^ (uint64_t)time.tv_nsec << 16
+			^ (uint64_t)getpid();
+	}
+
+	return sequence >> 16 | 1;
+}
+
+
+static inline int
+sameAddress(const struct sockaddr_in *one, const struct sockaddr_in *two)
+{
+	return one->sin_addr.s_addr == two->sin_addr.s_addr
+		&& one->sin_port == two->sin_port;
+}
+
+
+static int64_t
+retransmitTimeout(const struct subscriber *subscriber)
+{
+	if (subscriber->smoothedRoundTripTime == 0)
+		return INITIAL_TIMEOUT;
+
+	int64_t timeout = subscriber->smoothedRoundTripTime
+		+ 4 * subscriber->roundTripTimeVariation;
+	return timeout < MIN_TIMEOUT ? MIN_TIMEOUT
+		: timeout > MAX_TIMEOUT ? MAX_TIMEOUT : timeout;
+}
+
+
+static void
+recordRoundTripTime(struct subscriber *subscriber, int64_t sent, int64_t now)
+{
+	// Each transmission carries its own send time, so samples are unambiguous
+	// even for retransmitted cues.
+	int64_t sample = now - sent;
+	if (sent <= 0 || sample < 0 || sample > MAX_TIMEOUT)
+		return;
+
+	if (subscriber->smoothedRoundTripTime == 0) {
+		subscriber->smoothedRoundTripTime = sample;
+		subscriber->roundTripTimeVariation = sample / 2;
+		return;
+	}
+
+	int64_t deviation = sample - subscriber->smoothedRoundTripTime;
+	subscriber->roundTripTimeVariation
+		+= ((deviation < 0 ? -deviation : deviation)
+			- subscriber->roundTripTimeVariation) / 4;
+	subscriber->smoothedRoundTripTime += deviation / 8;
+}
+
+
+static int64_t
+leadTime(struct service *service)
+{
+	// Long enough for the slowest subscriber to receive the cue even when the
+	// configured number of retransmissions is needed. These back off like in
+	// processCues, the last one leaves after the sum of the waits before it
+	// and then takes the one way delay to arrive.
+	int64_t lead = 0;
+	for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+		struct subscriber *subscriber = &service->subscribers[i];
+		if (subscriber->lastSeen == 0)
+			continue;
+
+		int64_t timeout = retransmitTimeout(subscriber);
+		int64_t needed = (subscriber->smoothedRoundTripTime != 0
+			? subscriber->smoothedRoundTripTime : timeout) / 2;
+		for (int k = 0; k < service->retransmissions; k++)
+			needed += timeout << (k < MAX_BACKOFF ? k : MAX_BACKOFF);
+
+		if (needed > lead)
+			lead = needed;
+	}
+
+	return lead + service->margin;
+}
+
+
+static struct subscriber *
+findSubscriber(struct service *service, struct sockaddr_in *address,
+	int create, int64_t now)
+{
+	struct subscriber *unused = NULL;
+	for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+		struct subscriber *subscriber = &service->subscribers[i];
+		if (subscriber->lastSeen == 0) {
+			if (unused == NULL)
+				unused = subscriber;
+			continue;
+		}
+
+		if (sameAddress(&subscriber->address, address))
+			return subscriber;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (unused == NULL) {
+		printf("subscriber table full\n");
+		return NULL;
+	}
+
+	memset(unused, 0, sizeof(*unused));
+	unused->address = *address;
+	unused->lastSeen = now;
+
+	// Pending cues are delivered to new subscribers as well.
+	size_t index = unused - service->subscribers;
+	for (size_t i = 0; i < MAX_CUES; i++) {
+		struct delivery *delivery = &service->cues[i].deliveries[index];
+		delivery->nextSend = now;
+		delivery->attempts = 0;
+		delivery->acknowledged = 0;
+	}
+
+	char name[INET_ADDRSTRLEN];
+	printf("subscriber %s:%u added\n", inet_ntop(AF_INET, &address->sin_addr,
+		name, sizeof(name)), ntohs(address->sin_port));
+	return unused;
+}
+
+
+static void
+reply(struct service *service, struct sockaddr_in *address, uint32_t flags,
+	uint64_t sequence, int64_t time, int64_t sent)
+{
+	struct driftsync_cue packet;
+	packet.magic = DRIFTSYNC_MAGIC;
+	packet.flags = DRIFTSYNC_FLAG_CUE | flags;
+	packet.sequence = sequence;
+	packet.time = time;
+	packet.sent = sent;
+	packet.length = 0;
+
+	if (sendto(service->socket, &packet, DRIFTSYNC_CUE_HEADER_LENGTH, 0,
+			(struct sockaddr *)address, sizeof(*address)) < 0) {
+		printf("failed to send reply: %s\n", strerror(errno));
+	}
+}
+
+
+static void
+publish(struct service *service, struct driftsync_cue *packet,
+	struct sockaddr_in *address, int64_t now)
+{
+	for (size_t i = 0; i < PUBLICATION_HISTORY; i++) {
+		struct publication *publication = &service->publications[i];
+		if (publication->id == packet->sequence
+			&& sameAddress(&publication->address, address)) {
+			reply(service, address, DRIFTSYNC_CUE_PUBLISH
+				| DRIFTSYNC_CUE_ACKNOWLEDGE, packet->sequence,
+				publication->time, 0);
+			return;
+		}
+	}
+
+	struct cue *cue = NULL;
+	for (size_t i = 0; i < MAX_CUES && cue == NULL; i++) {
+		if (service->cues[i].sequence == 0)
+			cue = &service->cues[i];
+	}
+
+	// Rejected while not synchronized, when full or for cues already due.
+	int64_t global = DRIFTsync_globalTimeMicroseconds(service->sync);
+	int64_t time = packet->time != 0 ? (int64_t)packet->time
+		: global + leadTime(service);
+	if (global == 0 || cue == NULL || time <= global)
+		time = 0;
+
+	if (time != 0) {
+		cue->sequence = service->nextSequence++;
+		if (service->nextSequence == 0)
+			service->nextSequence = 1;
+
+		cue->time = time;
+		cue->length = packet->length;
+		memcpy(cue->payload, packet->payload, packet->length);
+		for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+			cue->deliveries[i].nextSend = now;
+			cue->deliveries[i].attempts = 0;
+			cue->deliveries[i].acknowledged = 0;
+		}
+
+		if (service->verbose) {
+			printf("cue %" PRIu64 " of %u bytes due in %.3f ms\n",
+				cue->sequence, cue->length, (time - global) / 1000.0);
+		}
+	} else
+		printf("rejected cue %s\n", global == 0 ? "while not synchronized"
+			: cue == NULL ? "as too many are pending" : "already due");
+
+	struct publication *publication
+		= &service->publications[service->publicationPosition];
+	service->publicationPosition
+		= (service->publicationPosition + 1) % PUBLICATION_HISTORY;
+	publication->address = *address;
+	publication->id = packet->sequence;
+	publication->time = time;
+
+	reply(service, address, DRIFTSYNC_CUE_PUBLISH | DRIFTSYNC_CUE_ACKNOWLEDGE,
+		packet->sequence, time, 0);
+}
+
+
+static void
+acknowledge(struct service *service, struct driftsync_cue *packet,
+	struct sockaddr_in *address, int64_t now)
+{
+	struct subscriber *subscriber = findSubscriber(service, address, 0, now);
+	if (subscriber == NULL)
+		return;
+
+	recordRoundTripTime(subscriber, packet->sent, now);
+
+	size_t index = subscriber - service->subscribers;
+	for (size_t i = 0; i < MAX_CUES; i++) {
+		if (service->cues[i].sequence == packet->sequence) {
+			service->cues[i].deliveries[index].acknowledged = 1;
+			break;
+		}
+	}
+}
+
+
+static void
+receivePacket(struct service *service, int64_t now)
+{
+	struct driftsync_cue packet;
+	struct sockaddr_storage remote;
+	socklen_t remoteLength = sizeof(remote);
+	ssize_t result = recvfrom(service->socket, &packet, sizeof(packet),
+		MSG_DONTWAIT, (struct sockaddr *)&remote, &remoteLength);
+	if (result < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			printf("failed to receive: %s\n", strerror(errno));
+		return;
+	}
+
+	if (result < (ssize_t)DRIFTSYNC_CUE_HEADER_LENGTH
+		|| remote.ss_family != AF_INET || packet.magic != DRIFTSYNC_MAGIC
+		|| (packet.flags & DRIFTSYNC_FLAG_CUE) == 0
+		|| packet.length > DRIFTSYNC_CUE_PAYLOAD
+		|| result < (ssize_t)DRIFTSYNC_CUE_HEADER_LENGTH + packet.length) {
+		printf("received invalid packet of %d\n", (int)result);
+		return;
+	}
+
+	struct sockaddr_in *address = (struct sockaddr_in *)&remote;
+	uint32_t type = packet.flags & (DRIFTSYNC_CUE_SUBSCRIBE
+		| DRIFTSYNC_CUE_PUBLISH | DRIFTSYNC_CUE_ACKNOWLEDGE);
+
+	if (type == DRIFTSYNC_CUE_SUBSCRIBE) {
+		struct subscriber *subscriber
+			= findSubscriber(service, address, 1, now);
+		if (subscriber == NULL)
+			return;
+
+		subscriber->lastSeen = now;
+		reply(service, address, DRIFTSYNC_CUE_SUBSCRIBE
+			| DRIFTSYNC_CUE_ACKNOWLEDGE, 0, 0, now);
+	} else if (type == (DRIFTSYNC_CUE_SUBSCRIBE | DRIFTSYNC_CUE_ACKNOWLEDGE)) {
+		struct subscriber *subscriber
+			= findSubscriber(service, address, 0, now);
+		if (subscriber != NULL)
+			recordRoundTripTime(subscriber, packet.sent, now);
+	} else if (type == DRIFTSYNC_CUE_PUBLISH)
+		publish(service, &packet, address, now);
+	else if (type == DRIFTSYNC_CUE_ACKNOWLEDGE)
+		acknowledge(service, &packet, address, now);
+}
+
+
+static void
+sendCue(struct service *service, struct cue *cue,
+	struct subscriber *subscriber, int64_t now)
+{
+	struct driftsync_cue packet;
+	packet.magic = DRIFTSYNC_MAGIC;
+	packet.flags = DRIFTSYNC_FLAG_CUE;
+	packet.sequence = cue->sequence;
+	packet.time = cue->time;
+	packet.sent = now;
+	packet.length = cue->length;
+	memcpy(packet.payload, cue->payload, cue->length);
+
+	if (sendto(service->socket, &packet,
+			DRIFTSYNC_CUE_HEADER_LENGTH + cue->length, 0,
+			(struct sockaddr *)&subscriber->address,
+			sizeof(subscriber->address)) < 0) {
+		printf("failed to send cue: %s\n", strerror(errno));
+	}
+}
+
+
+static int64_t
+processCues(struct service *service, int64_t now)
+{
+	// Returns the local time of the next transmission.
+	int64_t global = DRIFTsync_globalTimeMicroseconds(service->sync);
+	int64_t next = now + 1000 * 1000;
+
+	for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+		struct subscriber *subscriber = &service->subscribers[i];
+		if (subscriber->lastSeen != 0
+			&& now - subscriber->lastSeen > SUBSCRIBER_TIMEOUT) {
+			char name[INET_ADDRSTRLEN];
+			printf("subscriber %s:%u timed out\n", inet_ntop(AF_INET,
+					&subscriber->address.sin_addr, name, sizeof(name)),
+				ntohs(subscriber->address.sin_port));
+			subscriber->lastSeen = 0;
+		}
+	}
+
+	for (size_t i = 0; i < MAX_CUES; i++) {
+		struct cue *cue = &service->cues[i];
+		if (cue->sequence == 0)
+			continue;
+
+		int due = global != 0 && global >= cue->time;
+		unsigned delivered = 0;
+		unsigned missed = 0;
+		for (size_t j = 0; j < MAX_SUBSCRIBERS; j++) {
+			struct subscriber *subscriber = &service->subscribers[j];
+			struct delivery *delivery = &cue->deliveries[j];
+			if (subscriber->lastSeen == 0)
+				continue;
+
+			if (delivery->acknowledged) {
+				delivered++;
+				continue;
+			}
+
+			if (due) {
+				missed++;
+				continue;
+			}
+
+			if (delivery->nextSend <= now) {
+				sendCue(service, cue, subscriber, now);
+				int backoff = delivery->attempts < MAX_BACKOFF
+					? delivery->attempts : MAX_BACKOFF;
+				delivery->nextSend = now
+					+ (retransmitTimeout(subscriber) << backoff);
+				delivery->attempts++;
+			}
+
+			if (delivery->nextSend < next)
+				next = delivery->nextSend;
+		}
+
+		if (!due)
+			continue;
+
+		if (missed > 0 || service->verbose) {
+			printf("cue %" PRIu64 " due, delivered to %u, missed by %u\n",
+				cue->sequence, delivered, missed);
+		}
+
+		cue->sequence = 0;
+	}
+
+	return next;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	const char *server = "localhost";
+	uint16_t port = DRIFTSYNC_CUE_PORT;
+
+	struct service *service
+		= (struct service *)calloc(1, sizeof(struct service));
+	if (service == NULL) {
+		printf("out of memory allocating service\n");
+		return 1;
+	}
+
+	service->margin = 1000;
+	service->retransmissions = 2;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
+			service->verbose = 1;
+		else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+			server = argv[++i];
+		else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc
+			&& atoi(argv[i + 1]) > 0) {
+			port = (uint16_t)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--margin") == 0 && i + 1 < argc
+			&& atoi(argv[i + 1]) >= 0) {
+			service->margin = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--retransmissions") == 0 && i + 1 < argc
+			&& atoi(argv[i + 1]) >= 0) {
+			service->retransmissions = atoi(argv[++i]);
+		} else {
+			printf("usage: %s [-v|--verbose] [--server <host>] [--port <port>]"
+				"\n\t[--margin <microseconds>] [--retransmissions <n>]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &exit;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	service->sync = DRIFTsync_create(server, DRIFTSYNC_PORT, 1.0,
+		1000 * 1000, 0);
+	if (service->sync == NULL)
+		return 1;
+
+	service->socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (service->socket < 0) {
+		printf("failed to create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	int reuse = 1;
+	int result = setsockopt(service->socket, SOL_SOCKET, SO_REUSEADDR, &reuse,
+		sizeof(reuse));
+	if (result != 0) {
+		printf("failed to set address reuse socket option: %s\n",
+			strerror(errno));
+		// non-fatal
+	}
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	result = bind(service->socket, (struct sockaddr *)&address,
+		sizeof(address));
+	if (result != 0) {
+		printf("failed to bind to local port: %s\n", strerror(errno));
+		return 1;
+	}
+
+	service->nextSequence = randomSequence();
+
+	while (1) {
+		int64_t now = localTime();
+		int64_t wait = processCues(service, now) - now;
+		if (wait < 0)
+			wait = 0;
+
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(service->socket, &readSet);
+
+		struct timeval timeout = {
+			.tv_sec = wait / 1000 / 1000,
+			.tv_usec = wait % (1000 * 1000)
+		};
+
+		result = select(service->socket + 1, &readSet, NULL, NULL, &timeout);
+		if (result < 0 && errno != EINTR) {
+			printf("failed to wait for packets: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if (result > 0)
+			receivePacket(service, localTime());
+	}
+
+	return 0;
+}
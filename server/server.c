@@ -1,6 +1,9 @@
 #include <driftsync.h>
+#include <driftsync_probes.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,11 +11,62 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/select.h>
 #include <sys/socket.h>
 
 #include <netinet/in.h>
 
 
+#define RATE_SAMPLES			64
+#define MAX_RATE_CORRECTION		500e-6
+#define MAX_RATE_CHANGE			10e-9
+	// per second, so that clients see the rate change as smooth drift
+
+#define TELEMETRY_CLIENTS		4096
+#define TELEMETRY_PROBES		16
+#define TELEMETRY_EXPIRY		6
+	// windows after which the entry of a silent client is reused
+
+#define WHEEL_SLOTS				4096
+#define WHEEL_TICK				100
+	// microseconds per slot, delays further out take multiple turns
+#define WHEEL_ENTRIES			16384
+#define REORDER_DELAY			10000
+	// extra delay in microseconds of replies held back to be reordered
+
+#define DELAY_FIXED				0
+#define DELAY_UNIFORM			1
+#define DELAY_EXPONENTIAL		2
+
+
+// Corrects the rate of the served time base by that of the NTP disciplined
+// realtime clock measured over a long window. The local times are those of
+// the raw monotonic clock, which runs at the rate of the oscillator.
+
+struct rate_sample {
+	int64_t local;
+	int64_t realtime;
+};
+
+
+struct rate_correction {
+	int64_t window;
+	int64_t sampleInterval;
+	struct rate_sample samples[RATE_SAMPLES];
+	size_t count;
+	size_t position;
+	double correction;
+	int64_t baseLocal;
+	int64_t baseServed;
+	int updated;
+		// the correction changed since it was last logged
+	double estimate;
+	int64_t span;
+	int64_t clockSet;
+		// step of the realtime clock not logged yet, 0 for none
+};
+
+
 static inline uint64_t
 localTime()
 {
@@ -24,19 +78,719 @@ localTime()
 }
 
 
+static inline int64_t
+rawTime()
+{
+#ifdef CLOCK_MONOTONIC_RAW
+	// The monotonic clock gets the same frequency correction by a time daemon
+	// as the realtime clock, measuring against it would always yield zero.
+	struct timespec time;
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &time) == 0)
+		return (int64_t)time.tv_sec * 1000 * 1000 + time.tv_nsec / 1000;
+#endif
+	return (int64_t)localTime();
+}
+
+
+static inline int64_t
+suspendedTime()
+{
+#ifdef CLOCK_BOOTTIME
+	// The boot time clock only differs from the monotonic clock by the time
+	// spent suspended or frozen, during which the served time base stalls.
+	struct timespec boot;
+	if (clock_gettime(CLOCK_BOOTTIME, &boot) != 0)
+		return 0;
+
+	return (int64_t)boot.tv_sec * 1000 * 1000 + boot.tv_nsec / 1000
+		- (int64_t)localTime();
+#else
+	return 0;
+#endif
+}
+
+
+static inline int64_t
+wallClockOffset(clockid_t clock, int64_t served)
+{
+	struct timespec time;
+	if (clock_gettime(clock, &time) != 0)
+		return 0;
+
+	return (int64_t)time.tv_sec * 1000 * 1000 + time.tv_nsec / 1000 - served;
+}
+
+
+// Latest telemetry of each client, in a fixed size open addressing table that
+// is only ever touched by the main loop.
+
+struct telemetry_client {
+	uint32_t address;
+	uint16_t port;
+	uint16_t seen;
+	int64_t lastSeen;
+	struct driftsync_telemetry latest;
+	struct driftsync_telemetry windowStart;
+};
+
+
+struct telemetry {
+	int64_t window;
+	int64_t windowStart;
+	unsigned dropped;
+	struct telemetry_client clients[TELEMETRY_CLIENTS];
+	uint16_t residuals[TELEMETRY_CLIENTS];
+	uint16_t roundTripTimes[TELEMETRY_CLIENTS];
+};
+
+
+static void
+recordTelemetry(struct telemetry *telemetry, struct sockaddr_storage *remote,
+	struct driftsync_packet *packet, int64_t now)
+{
+	if (remote->ss_family != AF_INET)
+		return;
+
+	struct sockaddr_in *address = (struct sockaddr_in *)remote;
+	uint32_t hash = (address->sin_addr.s_addr ^ address->sin_port)
+		* 2654435761u;
+
+	struct telemetry_client *client = NULL;
+	struct telemetry_client *unused = NULL;
+	for (size_t i = 0; i < TELEMETRY_PROBES; i++) {
+		struct telemetry_client *entry
+			= &telemetry->clients[(hash + i) % TELEMETRY_CLIENTS];
+		if (entry->lastSeen != 0
+			&& entry->address == address->sin_addr.s_addr
+			&& entry->port == address->sin_port) {
+			client = entry;
+			break;
+		}
+
+		if (unused == NULL && (entry->lastSeen == 0 || now - entry->lastSeen
+				> TELEMETRY_EXPIRY * telemetry->window)) {
+			unused = entry;
+		}
+	}
+
+	struct driftsync_telemetry latest;
+	memcpy(&latest, &packet->epoch, sizeof(latest));
+
+	if (client == NULL) {
+		if (unused == NULL) {
+			telemetry->dropped++;
+			return;
+		}
+
+		// Counters of new clients only count from here on.
+		client = unused;
+		client->address = address->sin_addr.s_addr;
+		client->port = address->sin_port;
+		client->windowStart = latest;
+	}
+
+	client->latest = latest;
+	client->lastSeen = now;
+	client->seen = 1;
+}
+
+
+static int
+compare_uint16_t(const void *one, const void *two)
+{
+	return *(const uint16_t *)one - *(const uint16_t *)two;
+}
+
+
+static void
+reportTelemetry(struct telemetry *telemetry)
+{
+	size_t count = 0;
+	uint64_t rejected = 0;
+	uint64_t lost = 0;
+	for (size_t i = 0; i < TELEMETRY_CLIENTS; i++) {
+		struct telemetry_client *client = &telemetry->clients[i];
+		if (!client->seen)
+			continue;
+
+		int residual = client->latest.residual;
+		telemetry->residuals[count] = residual < 0 ? -residual : residual;
+		telemetry->roundTripTimes[count] = client->latest.roundTripTime;
+		count++;
+
+		// The counters wrap around, their difference stays correct.
+		rejected += (uint16_t)(client->latest.rejected
+			- client->windowStart.rejected);
+		lost += (uint16_t)(client->latest.lost - client->windowStart.lost);
+		client->windowStart = client->latest;
+		client->seen = 0;
+	}
+
+	printf("telemetry of %zu clients", count);
+	if (count > 0) {
+		qsort(telemetry->residuals, count, sizeof(uint16_t), compare_uint16_t);
+		qsort(telemetry->roundTripTimes, count, sizeof(uint16_t),
+			compare_uint16_t);
+
+		uint16_t *residuals = telemetry->residuals;
+		uint16_t *roundTripTimes = telemetry->roundTripTimes;
+		printf(", residual p50 %u p90 %u p99 %u us, round trip time p50 %u"
+			" p90 %u p99 %u us, %" PRIu64 " rejected, %" PRIu64 " lost",
+			residuals[(count - 1) * 50 / 100],
+			residuals[(count - 1) * 90 / 100],
+			residuals[(count - 1) * 99 / 100],
+			roundTripTimes[(count - 1) * 50 / 100] * 10,
+			roundTripTimes[(count - 1) * 90 / 100] * 10,
+			roundTripTimes[(count - 1) * 99 / 100] * 10, rejected, lost);
+	}
+
+	if (telemetry->dropped > 0) {
+		printf(", %u updates dropped with full table", telemetry->dropped);
+		telemetry->dropped = 0;
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+
+// Impairment of replies for testing clients against bad networks and clocks.
+// Replies to be delayed are kept in a timer wheel that the main loop runs
+// while it waits for requests.
+
+struct delayed_reply {
+	struct delayed_reply *next;
+	int64_t due;
+	struct sockaddr_storage remote;
+	socklen_t remoteLength;
+	int length;
+	struct driftsync_wall_clock_packet buffer;
+};
+
+
+struct impairment {
+	uint64_t random;
+	double drop;
+	double duplicate;
+	double reorder;
+	double corrupt;
+	int delayDistribution;
+	int64_t delay;
+	int delayRequests;
+	double skew;
+	int64_t step;
+	int64_t stepAfter;
+	int64_t start;
+	int64_t tick;
+	size_t pending;
+	unsigned overflows;
+	int verbose;
+	struct delayed_reply *free;
+	struct delayed_reply *slots[WHEEL_SLOTS];
+	struct delayed_reply entries[WHEEL_ENTRIES];
+};
+
+
+static int
+parseImpairment(struct impairment **_impairment, int argc, char *argv[])
+{
+	// Returns the number of arguments used, 0 for unknown ones and -1 when
+	// running out of memory.
+	static const char *options[] = { "--seed", "--drop", "--duplicate",
+		"--reorder", "--corrupt", "--delay", "--skew", "--step",
+		"--delay-requests" };
+	static const int values[] = { 1, 1, 1, 1, 1, 2, 1, 2, 0 };
+
+	size_t option = 0;
+	while (option < sizeof(values) / sizeof(values[0])
+		&& strcmp(argv[0], options[option]) != 0) {
+		option++;
+	}
+
+	if (option == sizeof(values) / sizeof(values[0]) || argc <= values[option])
+		return 0;
+
+	struct impairment *impairment = *_impairment;
+	if (impairment == NULL) {
+		impairment = (struct impairment *)calloc(1, sizeof(struct impairment));
+		if (impairment == NULL) {
+			printf("out of memory allocating impairment\n");
+			return -1;
+		}
+
+		impairment->random = 1;
+		for (size_t i = 0; i < WHEEL_ENTRIES; i++) {
+			impairment->entries[i].next = impairment->free;
+			impairment->free = &impairment->entries[i];
+		}
+
+		*_impairment = impairment;
+	}
+
+	switch (option) {
+		case 0:
+			impairment->random = strtoull(argv[1], NULL, 0);
+			if (impairment->random == 0)
+				impairment->random = 1;
+			break;
+		case 1:
+			impairment->drop = atof(argv[1]) / 100;
+			break;
+		case 2:
+			impairment->duplicate = atof(argv[1]) / 100;
+			break;
+		case 3:
+			impairment->reorder = atof(argv[1]) / 100;
+			break;
+		case 4:
+			impairment->corrupt = atof(argv[1]) / 100;
+			break;
+		case 5:
+			if (strcmp(argv[1], "fixed") == 0)
+				impairment->delayDistribution = DELAY_FIXED;
+			else if (strcmp(argv[1], "uniform") == 0)
+				impairment->delayDistribution = DELAY_UNIFORM;
+			else if (strcmp(argv[1], "exponential") == 0)
+				impairment->delayDistribution = DELAY_EXPONENTIAL;
+			else
+				return 0;
+
+			impairment->delay = atoll(argv[2]);
+			break;
+		case 6:
+			impairment->skew = atof(argv[1]) / 1000 / 1000;
+			break;
+		case 7:
+			impairment->step = atoll(argv[1]);
+			impairment->stepAfter = atoll(argv[2]) * 1000 * 1000;
+			break;
+		case 8:
+			impairment->delayRequests = 1;
+			break;
+	}
+
+	return values[option] + 1;
+}
+
+
+static double
+impairmentRandom(struct impairment *impairment)
+{
+	// xorshift64*, deterministic for a given seed and request sequence.
+	uint64_t x = impairment->random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	impairment->random = x;
+	return ((x * 0x2545f4914f6cdd1dull) >> 11) * 0x1.0p-53;
+}
+
+
+static int64_t
+impairmentDelay(struct impairment *impairment)
+{
+	int64_t delay = impairment->delay;
+	switch (impairment->delayDistribution) {
+		case DELAY_UNIFORM:
+			delay = (int64_t)(2 * delay * impairmentRandom(impairment));
+			break;
+		case DELAY_EXPONENTIAL:
+			delay = (int64_t)(-delay * log(1 - impairmentRandom(impairment)));
+			break;
+	}
+
+	if (impairment->reorder > 0
+		&& impairmentRandom(impairment) < impairment->reorder) {
+		delay += REORDER_DELAY;
+	}
+
+	return delay;
+}
+
+
+static void
+sendReply(int sock, struct driftsync_wall_clock_packet *buffer, int length,
+	struct sockaddr_storage *remote, socklen_t remoteLength, int verbose)
+{
+	struct driftsync_packet *packet = &buffer->packet;
+	int result = sendto(sock, buffer, length, 0, (struct sockaddr *)remote,
+		remoteLength);
+
+	DRIFTSYNC_PROBE(reply_send, result, packet->local, packet->remote);
+
+	if (verbose) {
+		printf("processed request packet, remote time %" PRIu64
+			", local time %" PRIu64 "\n", packet->local, packet->remote);
+	}
+
+	if (result < 0)
+		printf("failed to send: %s\n", strerror(errno));
+	else if (result != length)
+		printf("sent incomplete packet of %d\n", result);
+}
+
+
+static void
+scheduleReply(struct impairment *impairment, int sock,
+	struct driftsync_wall_clock_packet *buffer, int length,
+	struct sockaddr_storage *remote, socklen_t remoteLength, int64_t due)
+{
+	struct delayed_reply *reply = impairment->free;
+	if (reply == NULL) {
+		// Rather send it right away than lose it as that is not asked for.
+		impairment->overflows++;
+		if ((impairment->overflows & (impairment->overflows - 1)) == 0) {
+			printf("delay queue full, sent %u replies without delay\n",
+				impairment->overflows);
+		}
+
+		sendReply(sock, buffer, length, remote, remoteLength,
+			impairment->verbose);
+		return;
+	}
+
+	impairment->free = reply->next;
+	reply->due = due;
+	reply->remote = *remote;
+	reply->remoteLength = remoteLength;
+	reply->length = length;
+	memcpy(&reply->buffer, buffer, length);
+
+	// Into the first tick starting at or after the due time, which is run
+	// once the reply is due, and never into a slot that was already run for
+	// this turn of the wheel.
+	int64_t tick = (due + WHEEL_TICK - 1) / WHEEL_TICK;
+	if (tick <= impairment->tick)
+		tick = impairment->tick + 1;
+
+	struct delayed_reply **slot = &impairment->slots[tick % WHEEL_SLOTS];
+	reply->next = *slot;
+	*slot = reply;
+	impairment->pending++;
+}
+
+
+static void
+runWheel(struct impairment *impairment, int sock, int64_t now)
+{
+	int64_t tick = now / WHEEL_TICK;
+	if (impairment->pending == 0 || tick - impairment->tick > WHEEL_SLOTS) {
+		// Nothing to catch up on or all slots are visited once anyway.
+		if (impairment->pending == 0) {
+			impairment->tick = tick;
+			return;
+		}
+
+		impairment->tick = tick - WHEEL_SLOTS;
+	}
+
+	while (impairment->tick < tick) {
+		impairment->tick++;
+
+		struct delayed_reply **next
+			= &impairment->slots[impairment->tick % WHEEL_SLOTS];
+		while (*next != NULL) {
+			struct delayed_reply *reply = *next;
+			if (reply->due > now) {
+				next = &reply->next;
+				continue;
+			}
+
+			sendReply(sock, &reply->buffer, reply->length, &reply->remote,
+				reply->remoteLength, impairment->verbose);
+
+			*next = reply->next;
+			reply->next = impairment->free;
+			impairment->free = reply;
+			impairment->pending--;
+		}
+	}
+}
+
+
+static void
+waitForRequest(struct impairment *impairment, int sock)
+{
+	// Runs the delayed replies that become due until a request arrives.
+	while (1) {
+		int64_t now = localTime();
+		runWheel(impairment, sock, now);
+
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(sock, &set);
+
+		struct timeval timeout = { 0, 0 };
+		if (impairment->pending > 0) {
+			int64_t wait = (impairment->tick + 1) * WHEEL_TICK - now;
+			timeout.tv_usec = wait > 0 ? wait : 0;
+		}
+
+		int result = select(sock + 1, &set, NULL, NULL,
+			impairment->pending > 0 ? &timeout : NULL);
+		if (result > 0)
+			return;
+
+		if (result < 0 && errno != EINTR) {
+			printf("failed to wait for requests: %s\n", strerror(errno));
+			return;
+		}
+	}
+}
+
+
+static void
+impairReply(struct impairment *impairment, int sock,
+	struct driftsync_wall_clock_packet *buffer, int length,
+	struct sockaddr_storage *remote, socklen_t remoteLength, int64_t now)
+{
+	struct driftsync_packet *packet = &buffer->packet;
+	if (impairment->drop > 0 && impairmentRandom(impairment) < impairment->drop)
+		return;
+
+	if (impairment->corrupt > 0
+		&& impairmentRandom(impairment) < impairment->corrupt) {
+		packet->magic = ~packet->magic;
+	}
+
+	// Only the served time is off, the wall clock offset keeps mapping it to
+	// the correct wall clock time.
+	if (impairment->start == 0)
+		impairment->start = now;
+
+	int64_t elapsed = now - impairment->start;
+	int64_t error = (int64_t)(elapsed * impairment->skew);
+	if (impairment->step != 0 && elapsed >= impairment->stepAfter)
+		error += impairment->step;
+
+	packet->remote += error;
+	if (length == (int)sizeof(*buffer))
+		buffer->wallClockOffset -= error;
+
+	int copies = impairment->duplicate > 0
+		&& impairmentRandom(impairment) < impairment->duplicate ? 2 : 1;
+	for (int i = 0; i < copies; i++) {
+		// A request that took longer to arrive is stamped that much later,
+		// which stamping the later time and holding the reply back models.
+		int64_t delay = impairmentDelay(impairment);
+		int64_t requestDelay = impairment->delayRequests ? delay : 0;
+		packet->remote += requestDelay;
+
+		if (delay <= 0)
+			sendReply(sock, buffer, length, remote, remoteLength,
+				impairment->verbose);
+		else {
+			scheduleReply(impairment, sock, buffer, length, remote,
+				remoteLength, now + delay);
+		}
+
+		packet->remote -= requestDelay;
+	}
+}
+
+
+static inline int64_t
+servedTime(const struct rate_correction *rate, int64_t local)
+{
+	int64_t elapsed = local - rate->baseLocal;
+	return rate->baseServed + elapsed + (int64_t)(elapsed * rate->correction);
+}
+
+
+static void
+updateRateCorrection(struct rate_correction *rate, int64_t local)
+{
+	struct timespec time;
+	if (clock_gettime(CLOCK_REALTIME, &time) != 0)
+		return;
+
+	struct rate_sample sample = {
+		.local = local,
+		.realtime = (int64_t)time.tv_sec * 1000 * 1000 + time.tv_nsec / 1000
+	};
+
+	if (rate->count > 0) {
+		struct rate_sample *last = &rate->samples[rate->position];
+		int64_t elapsed = sample.local - last->local;
+		if (elapsed < rate->sampleInterval)
+			return;
+
+		// Small steps by a time daemon are part of keeping the realtime clock
+		// on time, but a larger one means the clock was set and is not
+		// related to the samples before anymore.
+		int64_t deviation = sample.realtime - last->realtime - elapsed;
+		if ((deviation < 0 ? -deviation : deviation)
+				> (int64_t)(elapsed * MAX_RATE_CORRECTION) + 500 * 1000) {
+			rate->clockSet = deviation;
+			rate->count = 0;
+		}
+	}
+
+	rate->position = (rate->position + 1) % RATE_SAMPLES;
+	rate->samples[rate->position] = sample;
+	if (rate->count < RATE_SAMPLES)
+		rate->count++;
+
+	// Forget samples that fell out of the window.
+	struct rate_sample *first;
+	while (1) {
+		first = &rate->samples[
+			(rate->position + RATE_SAMPLES + 1 - rate->count) % RATE_SAMPLES];
+		if (rate->count <= 2 || sample.local - first->local <= rate->window)
+			break;
+
+		rate->count--;
+	}
+
+	int64_t span = sample.local - first->local;
+	if (span < rate->window / 2)
+		return;
+
+	double estimate = (double)(sample.realtime - first->realtime) / span - 1;
+	if (estimate > MAX_RATE_CORRECTION)
+		estimate = MAX_RATE_CORRECTION;
+	if (estimate < -MAX_RATE_CORRECTION)
+		estimate = -MAX_RATE_CORRECTION;
+
+	// Approach the estimate gradually and continue the served time from where
+	// it is with the new rate.
+	int64_t elapsed = sample.local - rate->baseLocal;
+	if (elapsed > rate->sampleInterval)
+		elapsed = rate->sampleInterval;
+
+	double maxChange = MAX_RATE_CHANGE * elapsed / (1000 * 1000);
+	double change = estimate - rate->correction;
+	if (change > maxChange)
+		change = maxChange;
+	if (change < -maxChange)
+		change = -maxChange;
+
+	rate->baseServed = servedTime(rate, sample.local);
+	rate->baseLocal = sample.local;
+	rate->correction += change;
+
+	DRIFTSYNC_PROBE(rate_update, (int64_t)(rate->correction * 1e9),
+		(int64_t)(estimate * 1e9), span);
+
+	rate->updated = 1;
+	rate->estimate = estimate;
+	rate->span = span;
+}
+
+
+static void
+logRateCorrection(struct rate_correction *rate)
+{
+	// Separate from the update, which runs between taking the time of a
+	// request and sending the reply.
+	if (rate->clockSet != 0) {
+		printf("realtime clock set by %" PRId64 " us, restarting rate"
+			" estimate\n", rate->clockSet);
+		rate->clockSet = 0;
+	}
+
+	if (!rate->updated)
+		return;
+
+	printf("rate correction %.3f ppm, estimate %.3f ppm over %" PRId64 " s\n",
+		rate->correction * 1e6, rate->estimate * 1e6,
+		rate->span / 1000 / 1000);
+	fflush(stdout);
+	rate->updated = 0;
+}
+
+
+static uint64_t
+randomEpoch()
+{
+	uint64_t epoch = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &epoch, sizeof(epoch)) != (ssize_t)sizeof(epoch))
+			epoch = 0;
+		close(fd);
+	}
+
+	if (epoch == 0) {
+		struct timespec time;
+		clock_gettime(CLOCK_REALTIME, &time);
+		epoch = ((uint64_t)time.tv_sec << 32 ^ (uint64_t)time.tv_nsec << 16
+			^ (uint64_t)getpid()) | 1;
+	}
+
+	return epoch;
+}
+
+
 int
 main(int argc, char *argv[])
 {
 	int verbose = 0;
+	int wallClock = 0;
+	struct rate_correction rate;
+	memset(&rate, 0, sizeof(rate));
+	struct telemetry *telemetry = NULL;
+	struct impairment *impairment = NULL;
+	int used = 0;
+	clockid_t wallClockId = CLOCK_REALTIME;
 	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
 			verbose = 1;
-		else {
-			printf("usage: %s [-v|--verbose]\n", argv[0]);
+		else if (strcmp(argv[i], "--wall-clock") == 0 && i + 1 < argc
+			&& strcmp(argv[i + 1], "realtime") == 0) {
+			wallClock = DRIFTSYNC_FLAG_WALL_CLOCK;
+			wallClockId = CLOCK_REALTIME;
+			i++;
+#ifdef CLOCK_TAI
+		} else if (strcmp(argv[i], "--wall-clock") == 0 && i + 1 < argc
+			&& strcmp(argv[i + 1], "tai") == 0) {
+			wallClock = DRIFTSYNC_FLAG_WALL_CLOCK
+				| DRIFTSYNC_FLAG_WALL_CLOCK_TAI;
+			wallClockId = CLOCK_TAI;
+			i++;
+#endif
+		} else if (strcmp(argv[i], "--rate-correct") == 0 && i + 1 < argc
+			&& atoi(argv[i + 1]) > 0) {
+			rate.window = (int64_t)atoi(argv[i + 1]) * 1000 * 1000;
+			rate.sampleInterval = rate.window / RATE_SAMPLES;
+			if (rate.sampleInterval < 1000 * 1000)
+				rate.sampleInterval = 1000 * 1000;
+			i++;
+		} else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc
+			&& atoi(argv[i + 1]) > 0 && telemetry == NULL) {
+			telemetry = (struct telemetry *)calloc(1, sizeof(struct telemetry));
+			if (telemetry == NULL) {
+				printf("out of memory allocating telemetry table\n");
+				return 1;
+			}
+
+			telemetry->window = (int64_t)atoi(argv[i + 1]) * 1000 * 1000;
+			telemetry->windowStart = localTime();
+			i++;
+		} else if ((used = parseImpairment(&impairment, argc - i, argv + i))
+				!= 0) {
+			if (used < 0)
+				return 1;
+
+			i += used - 1;
+		} else {
+			printf("usage: %s [-v|--verbose] [--wall-clock realtime|tai]"
+				" [--rate-correct <seconds>] [--telemetry <seconds>]\n"
+				"\t[--seed <n>] [--drop <%%>] [--duplicate <%%>]"
+				" [--reorder <%%>] [--corrupt <%%>]\n"
+				"\t[--delay fixed|uniform|exponential <microseconds>]"
+				" [--delay-requests] [--skew <ppm>]\n"
+				"\t[--step <microseconds> <after seconds>]\n"
+				"--delay-requests delays the requests instead, to validate the"
+				" error bounds of\nclients against asymmetric delays\n",
+				argv[0]);
 			exit(1);
 		}
 	}
 
+	if (impairment != NULL)
+		impairment->verbose = verbose;
+
 	struct sigaction action;
 	memset(&action, 0, sizeof(action));
 	action.sa_handler = &exit;
@@ -68,51 +822,111 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
+	uint64_t epoch = randomEpoch();
+	uint32_t epochFlags = 0;
+	int64_t suspended = suspendedTime();
+
+	// Without correction, the served time is the local time. With it, the
+	// served time starts there and follows the corrected raw clock.
+	rate.baseServed = localTime();
+	rate.baseLocal = rate.window > 0 ? rawTime() : rate.baseServed;
+
 	struct sockaddr_storage remote;
-	struct driftsync_packet packet;
+	struct driftsync_wall_clock_packet buffer;
+	struct driftsync_packet *packet = &buffer.packet;
 	while (1) {
+		if (impairment != NULL)
+			waitForRequest(impairment, sock);
+
 		socklen_t remoteLength = sizeof(remote);
-		result = recvfrom(sock, &packet, sizeof(packet), 0,
+		result = recvfrom(sock, &buffer, sizeof(buffer), 0,
 			(struct sockaddr *)&remote, &remoteLength);
 
 		if (result < 0) {
+			DRIFTSYNC_PROBE(request_drop, DRIFTSYNC_DROP_RECEIVE, errno);
 			printf("failed to receive: %s\n", strerror(errno));
 			continue;
 		}
 
-		if (result < (int)sizeof(packet)) {
+		int length = (packet->flags & DRIFTSYNC_FLAG_WALL_CLOCK) != 0
+			? sizeof(buffer) : sizeof(*packet);
+		if (result < length) {
+			DRIFTSYNC_PROBE(request_drop, DRIFTSYNC_DROP_INCOMPLETE, result);
 			printf("received incomplete packet of %d\n", result);
 			continue;
 		}
 
-		if (packet.magic != DRIFTSYNC_MAGIC) {
+		// Only once the packet is known to contain the local time.
+		DRIFTSYNC_PROBE(request_receive, result, packet->local);
+
+		if (packet->magic != DRIFTSYNC_MAGIC) {
+			DRIFTSYNC_PROBE(request_drop, DRIFTSYNC_DROP_MAGIC, packet->magic);
 			printf("protocol mismatch\n");
 			continue;
 		}
 
-		if ((packet.flags & DRIFTSYNC_FLAG_REPLY) != 0) {
+		if ((packet->flags & DRIFTSYNC_FLAG_REPLY) != 0) {
+			DRIFTSYNC_PROBE(request_drop, DRIFTSYNC_DROP_FLAGS, packet->flags);
 			printf("received reply packet\n");
 			continue;
 		}
 
-		packet.flags |= DRIFTSYNC_FLAG_REPLY;
-		packet.remote = localTime();
-		result = sendto(sock, &packet, sizeof(packet), 0,
-			(struct sockaddr *)&remote, remoteLength);
+		if ((packet->flags & DRIFTSYNC_FLAG_WAKEUP) != 0) {
+			DRIFTSYNC_PROBE(request_drop, DRIFTSYNC_DROP_WAKEUP, packet->flags);
+			continue;
+		}
 
-		if (verbose) {
-			printf("processed request packet, remote time %" PRIu64
-				", local time %" PRIu64 "\n", packet.local, packet.remote);
+		int64_t nowSuspended = suspendedTime();
+		int64_t stepped = nowSuspended - suspended;
+		if ((stepped < 0 ? -stepped : stepped) > 10000) {
+			printf("clock discontinuity of %" PRId64 " us, new epoch\n",
+				stepped);
+			epoch = randomEpoch();
+			DRIFTSYNC_PROBE(epoch_change, stepped, epoch);
+			epochFlags = DRIFTSYNC_FLAG_CLOCK_STEPPED;
 		}
 
-		if (result < 0) {
-			printf("failed to send: %s\n", strerror(errno));
-			continue;
+		suspended = nowSuspended;
+
+		int64_t now = localTime();
+		int64_t raw = now;
+		if (rate.window > 0) {
+			raw = rawTime();
+			updateRateCorrection(&rate, raw);
 		}
 
-		if (result != (int)sizeof(packet)) {
-			printf("sent incomplete packet of %d\n", result);
-			continue;
+		// Recorded before the epoch overwrites the summary, but only reported
+		// after the reply is sent.
+		if (telemetry != NULL
+			&& (packet->flags & DRIFTSYNC_FLAG_TELEMETRY) != 0) {
+			recordTelemetry(telemetry, &remote, packet, now);
+		}
+
+		packet->flags |= DRIFTSYNC_FLAG_REPLY | epochFlags;
+		packet->remote = servedTime(&rate, raw);
+		packet->epoch = epoch;
+
+		if ((packet->flags & DRIFTSYNC_FLAG_WALL_CLOCK) != 0) {
+			packet->flags &= ~DRIFTSYNC_FLAG_WALL_CLOCK;
+			packet->flags |= wallClock;
+			buffer.wallClockOffset = wallClock != 0
+				? wallClockOffset(wallClockId, packet->remote) : 0;
+		}
+
+		if (impairment != NULL) {
+			impairReply(impairment, sock, &buffer, length, &remote,
+				remoteLength, now);
+		} else
+			sendReply(sock, &buffer, length, &remote, remoteLength, verbose);
+
+		// Only once the reply is on its way, to not delay it.
+		if (rate.window > 0)
+			logRateCorrection(&rate);
+
+		if (telemetry != NULL
+			&& now - telemetry->windowStart >= telemetry->window) {
+			reportTelemetry(telemetry);
+			telemetry->windowStart = now;
 		}
 	}
 